@@ -0,0 +1,444 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Bootlin
+ *
+ * Author: Joao Marcos Costa <joaomarcos.costa@bootlin.com>
+ *
+ * libsqfs.c: library interface, over a handle keeping the image state between
+ *	      calls
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "libsqfs.h"
+#include "sqfs_filesystem.h"
+#include "sqfs_utils.h"
+
+struct sqfs {
+	struct sqfs_image img;
+	struct sqfs_ctx ctx;
+	/* Content of block 'block_index' of file 'block_ref', if cached */
+	bool cached;
+	uint64_t block_ref, block_index;
+	unsigned char *block, *block_data;
+	size_t block_length;
+	/*
+	 * Data block 'cursor_index' of file 'cursor_ref' starts at
+	 * 'cursor_offset' in the image: sequential reads of a file do not
+	 * walk its block list from the start every time.
+	 */
+	uint64_t cursor_ref, cursor_index, cursor_offset;
+};
+
+int sqfs_open(struct sqfs **fs, const char *path)
+{
+	struct sqfs *s;
+	int ret;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return -ENOMEM;
+
+	ret = sqfs_image_open(&s->img, path, SQFS_IMAGE_AUTO, 0);
+	if (ret)
+		goto free_handle;
+
+	ret = sqfs_ctx_init(&s->ctx, &s->img);
+	if (ret)
+		goto close_image;
+
+	s->block = sqfs_buf_get(&s->ctx.buffers);
+	if (!s->block) {
+		ret = -ENOMEM;
+		goto free_ctx;
+	}
+
+	/* No file was read yet: the root is a directory */
+	s->cursor_ref = s->ctx.sblk->root_inode;
+	*fs = s;
+
+	return 0;
+
+free_ctx:
+	sqfs_ctx_free(&s->ctx);
+close_image:
+	sqfs_image_close(&s->img);
+free_handle:
+	free(s);
+
+	return ret;
+}
+
+void sqfs_close(struct sqfs *fs)
+{
+	if (!fs)
+		return;
+
+	sqfs_buf_put(&fs->ctx.buffers, fs->block);
+	sqfs_ctx_free(&fs->ctx);
+	sqfs_image_close(&fs->img);
+	free(fs);
+}
+
+static int sqfs_get_inode(struct sqfs *fs, uint64_t ref,
+			  union squashfs_inode *i)
+{
+	i->base = sqfs_read_inode_ref(&fs->ctx, ref);
+
+	return i->base ? 0 : -EINVAL;
+}
+
+/* Directory entries only use the basic types */
+static mode_t sqfs_type_mode(uint16_t type)
+{
+	if (type > SQUASHFS_SOCKET_TYPE)
+		type -= SQUASHFS_LDIR_TYPE - SQUASHFS_DIR_TYPE;
+
+	switch (type) {
+	case SQUASHFS_DIR_TYPE:
+		return S_IFDIR;
+	case SQUASHFS_REG_TYPE:
+		return S_IFREG;
+	case SQUASHFS_SYMLINK_TYPE:
+		return S_IFLNK;
+	case SQUASHFS_BLKDEV_TYPE:
+		return S_IFBLK;
+	case SQUASHFS_CHRDEV_TYPE:
+		return S_IFCHR;
+	case SQUASHFS_FIFO_TYPE:
+		return S_IFIFO;
+	case SQUASHFS_SOCKET_TYPE:
+		return S_IFSOCK;
+	default:
+		return 0;
+	}
+}
+
+int sqfs_lookup(struct sqfs *fs, const char *path, uint64_t *ref)
+{
+	struct sqfs_ctx *ctx = &fs->ctx;
+	char name[SQUASHFS_NAME_LEN + 1];
+	struct directory_header *header;
+	struct directory_entry *entry;
+	/* References of the directories walked through, for ".." */
+	uint64_t *parents = NULL, *p, cur;
+	int depth = 0, capacity = 0, ret = 0;
+	union squashfs_inode i;
+	size_t length;
+
+	cur = ctx->sblk->root_inode;
+	for (; *path; path += length) {
+		length = strcspn(path, "/");
+		if (!length) {
+			length = 1;
+			continue;
+		}
+
+		if (length == 1 && path[0] == '.')
+			continue;
+
+		if (length == 2 && !memcmp(path, "..", 2)) {
+			/* The root is its own parent */
+			if (depth)
+				cur = parents[--depth];
+			continue;
+		}
+
+		if (length > SQUASHFS_NAME_LEN) {
+			ret = -ENAMETOOLONG;
+			break;
+		}
+
+		memcpy(name, path, length);
+		name[length] = '\0';
+
+		ret = sqfs_get_inode(fs, cur, &i);
+		if (ret)
+			break;
+
+		ret = sqfs_dir_lookup(ctx, &i, name, &header, &entry);
+		if (ret)
+			break;
+
+		if (depth == capacity) {
+			capacity = capacity ? 2 * capacity : 16;
+			p = realloc(parents, capacity * sizeof(*parents));
+			if (!p) {
+				ret = -ENOMEM;
+				break;
+			}
+			parents = p;
+		}
+
+		parents[depth++] = cur;
+		cur = ((uint64_t)header->start << 16) | entry->offset;
+
+		/* As sqfs_resolve_path(), check the entry against its inode */
+		ret = sqfs_get_inode(fs, cur, &i);
+		if (!ret && i.base->inode_number !=
+		    header->inode_number + entry->inode_offset)
+			ret = -EINVAL;
+		if (ret)
+			break;
+	}
+
+	free(parents);
+	if (!ret)
+		*ref = cur;
+
+	return ret;
+}
+
+int sqfs_stat(struct sqfs *fs, uint64_t ref, struct stat *st)
+{
+	union squashfs_inode i;
+	uint32_t uid, gid;
+	int ret;
+
+	ret = sqfs_get_inode(fs, ref, &i);
+	if (ret)
+		return ret;
+
+	ret = sqfs_id_lookup(&fs->ctx, i.base->uid, &uid);
+	if (!ret)
+		ret = sqfs_id_lookup(&fs->ctx, i.base->guid, &gid);
+	if (ret)
+		return ret;
+
+	memset(st, 0, sizeof(*st));
+	st->st_ino = i.base->inode_number;
+	st->st_mode = sqfs_type_mode(i.base->inode_type) |
+		      (i.base->mode & 07777);
+	st->st_nlink = 1;
+	st->st_uid = uid;
+	st->st_gid = gid;
+	st->st_blksize = fs->ctx.sblk->block_size;
+	st->st_atime = i.base->mtime;
+	st->st_mtime = i.base->mtime;
+	st->st_ctime = i.base->mtime;
+
+	switch (i.base->inode_type) {
+	case SQUASHFS_DIR_TYPE:
+		st->st_nlink = i.dir->nlink;
+		st->st_size = i.dir->file_size;
+		break;
+	case SQUASHFS_LDIR_TYPE:
+		st->st_nlink = i.ldir->nlink;
+		st->st_size = i.ldir->file_size;
+		break;
+	case SQUASHFS_REG_TYPE:
+		st->st_size = i.reg->file_size;
+		break;
+	case SQUASHFS_LREG_TYPE:
+		st->st_nlink = i.lreg->nlink;
+		st->st_size = i.lreg->file_size;
+		break;
+	case SQUASHFS_SYMLINK_TYPE:
+	case SQUASHFS_LSYMLINK_TYPE:
+		st->st_nlink = i.symlink->nlink;
+		st->st_size = i.symlink->symlink_size;
+		break;
+	case SQUASHFS_BLKDEV_TYPE:
+	case SQUASHFS_CHRDEV_TYPE:
+	case SQUASHFS_LBLKDEV_TYPE:
+	case SQUASHFS_LCHRDEV_TYPE:
+		st->st_nlink = i.dev->nlink;
+		st->st_rdev = sqfs_rdev(i.dev->rdev);
+		break;
+	case SQUASHFS_FIFO_TYPE:
+	case SQUASHFS_SOCKET_TYPE:
+	case SQUASHFS_LFIFO_TYPE:
+	case SQUASHFS_LSOCKET_TYPE:
+		st->st_nlink = i.ipc->nlink;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	st->st_blocks = DIV_ROUND_UP(st->st_size, 512);
+
+	return 0;
+}
+
+int sqfs_readdir(struct sqfs *fs, uint64_t ref,
+		 int (*fn)(void *arg, const struct sqfs_entry *entry),
+		 void *arg)
+{
+	char name[SQUASHFS_NAME_LEN + 1];
+	struct sqfs_entry entry;
+	struct sqfs_dirent dirent;
+	struct sqfs_dir_iter iter;
+	union squashfs_inode i;
+	int ret;
+
+	ret = sqfs_get_inode(fs, ref, &i);
+	if (ret)
+		return ret;
+
+	if (!S_ISDIR(sqfs_type_mode(i.base->inode_type)))
+		return -ENOTDIR;
+
+	ret = sqfs_dir_iter_init(&iter, &fs->ctx.dir_table, &i);
+	if (ret)
+		return ret;
+
+	while ((ret = sqfs_dir_iter_next(&iter, &dirent)) > 0) {
+		if (dirent.name_length > SQUASHFS_NAME_LEN)
+			return -EINVAL;
+
+		memcpy(name, dirent.name, dirent.name_length);
+		name[dirent.name_length] = '\0';
+
+		entry.name = name;
+		entry.ref = dirent.inode_ref;
+		entry.ino = dirent.inode_number;
+		entry.type = sqfs_type_mode(dirent.type);
+
+		ret = fn(arg, &entry);
+		if (ret)
+			return ret;
+	}
+
+	return ret;
+}
+
+/*
+ * Get the content of block 'index' of 'file', the fragment being the block
+ * past the data blocks, from the cache or into fs->block
+ */
+static int sqfs_get_block(struct sqfs *fs, uint64_t ref,
+			  struct sqfs_file *file, uint64_t index,
+			  unsigned char **data, size_t *length)
+{
+	uint32_t block_size = fs->ctx.sblk->block_size;
+	struct sqfs_frag_cache_entry *frag;
+	uint64_t j, offset;
+	size_t size;
+	int ret;
+
+	if (fs->cached && fs->block_ref == ref && fs->block_index == index) {
+		*data = fs->block_data;
+		*length = fs->block_length;
+		return 0;
+	}
+
+	/* fs->block is about to be overwritten */
+	fs->cached = false;
+
+	if (index < file->block_count) {
+		j = 0;
+		offset = file->start_block;
+		if (fs->cursor_ref == ref && fs->cursor_index <= index) {
+			j = fs->cursor_index;
+			offset = fs->cursor_offset;
+		}
+
+		for (; j < index; j++)
+			offset += DATABLOCK_SIZE(file->block_list[j]);
+
+		fs->cursor_ref = ref;
+		fs->cursor_index = index;
+		fs->cursor_offset = offset;
+
+		ret = sqfs_read_datablock(&fs->ctx, &fs->ctx.decomp, offset,
+					  file->block_list[index], fs->block,
+					  data, &size);
+		if (ret)
+			return ret;
+	} else {
+		if (!IS_FRAGMENTED(file->fragment))
+			return -EINVAL;
+
+		ret = sqfs_frag_cache_get(&fs->ctx.frag_cache, &fs->ctx.decomp,
+					  file->fragment, &frag);
+		if (ret)
+			return ret;
+
+		size = file->file_size - index * block_size;
+		if (file->frag_offset > frag->size ||
+		    size > frag->size - file->frag_offset) {
+			sqfs_frag_cache_put(&fs->ctx.frag_cache, frag);
+			printe("%s: Invalid fragment offset.\n", __func__);
+			return -EINVAL;
+		}
+
+		memcpy(fs->block, frag->data + file->frag_offset, size);
+		sqfs_frag_cache_put(&fs->ctx.frag_cache, frag);
+		*data = fs->block;
+	}
+
+	fs->cached = true;
+	fs->block_ref = ref;
+	fs->block_index = index;
+	fs->block_data = *data;
+	fs->block_length = size;
+	*length = size;
+
+	return 0;
+}
+
+ssize_t sqfs_pread(struct sqfs *fs, uint64_t ref, void *buf, size_t len,
+		   uint64_t offset)
+{
+	uint32_t block_size = fs->ctx.sblk->block_size;
+	struct sqfs_file file;
+	union squashfs_inode i;
+	unsigned char *data;
+	size_t done, n, length, start;
+	uint64_t pos;
+	int ret;
+
+	ret = sqfs_get_inode(fs, ref, &i);
+	if (ret)
+		return ret;
+
+	switch (i.base->inode_type) {
+	case SQUASHFS_REG_TYPE:
+	case SQUASHFS_LREG_TYPE:
+		break;
+	case SQUASHFS_DIR_TYPE:
+	case SQUASHFS_LDIR_TYPE:
+		return -EISDIR;
+	default:
+		return -EINVAL;
+	}
+
+	ret = sqfs_file_init(&fs->ctx, &i, &file);
+	if (ret)
+		return ret;
+
+	if (offset >= file.file_size)
+		return 0;
+
+	if (len > file.file_size - offset)
+		len = file.file_size - offset;
+	if (len > SSIZE_MAX)
+		len = SSIZE_MAX;
+
+	for (done = 0; done < len; done += n) {
+		pos = offset + done;
+		ret = sqfs_get_block(fs, ref, &file, pos / block_size, &data,
+				     &length);
+		if (ret)
+			return ret;
+
+		start = pos % block_size;
+		if (start >= length)
+			return -EINVAL;
+
+		n = length - start;
+		if (n > len - done)
+			n = len - done;
+
+		memcpy((unsigned char *)buf + done, data + start, n);
+	}
+
+	return done;
+}
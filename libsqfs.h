@@ -0,0 +1,64 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2020 Bootlin
+ *
+ * Author: Joao Marcos Costa <joaomarcos.costa@bootlin.com>
+ *
+ * libsqfs.h:	read-only access to the files of a SquashFS image, the only
+ *		header a program linking with libsqfs needs
+ */
+
+#ifndef LIBSQFS_H
+#define LIBSQFS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/*
+ * An open image. It owns the image mapping, the tables read so far, the
+ * metadata and fragment caches and the last data block read, which are kept
+ * from one call to the next. A handle must not be used by several threads at
+ * once: open one per thread instead.
+ *
+ * Entries are designated by their inode reference, as found by sqfs_lookup()
+ * or sqfs_readdir(), which stays valid as long as the handle is open. Errors
+ * are returned as negative errno values.
+ */
+struct sqfs;
+
+/* Directory entry, as passed to the sqfs_readdir() callback */
+struct sqfs_entry {
+	/* Null-terminated, only valid during the callback */
+	const char *name;
+	uint64_t ref;
+	ino_t ino;
+	/* File type, as in st_mode (S_IFREG, S_IFDIR...) */
+	mode_t type;
+};
+
+/* 'path' is a file, a block device or - for stdin */
+int sqfs_open(struct sqfs **fs, const char *path);
+void sqfs_close(struct sqfs *fs);
+/*
+ * Resolve 'path' from the root of the image: "." and ".." components are
+ * honoured, symbolic links are not followed.
+ */
+int sqfs_lookup(struct sqfs *fs, const char *path, uint64_t *ref);
+int sqfs_stat(struct sqfs *fs, uint64_t ref, struct stat *st);
+/*
+ * Call 'fn' for each entry of a directory, in name order, until it returns
+ * non-zero: that value is then returned.
+ */
+int sqfs_readdir(struct sqfs *fs, uint64_t ref,
+		 int (*fn)(void *arg, const struct sqfs_entry *entry),
+		 void *arg);
+/*
+ * Read up to 'len' bytes at 'offset' in a regular file. Returns the number of
+ * bytes read, 0 past the end of the file.
+ */
+ssize_t sqfs_pread(struct sqfs *fs, uint64_t ref, void *buf, size_t len,
+		   uint64_t offset);
+
+#endif /* LIBSQFS_H */
@@ -9,23 +9,24 @@
  */
 
 #include <errno.h>
-#include <fcntl.h>
 #include <getopt.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
-#include <unistd.h>
+#include <string.h>
 
 #include "sqfs_filesystem.h"
 #include "sqfs_utils.h"
 
 #define SQFS_USAGE \
 	"usage: sqfs [-h]\n" \
-	"       sqfs [-s] [-i] [-d] <fs-image>\n" \
-	"       sqfs [-e] <fs-image> /path/to/dir/\n" \
-	"       sqfs [-e] <fs-image> /path/to/file\n" \
+	"       sqfs [-m mode] [-H] [-s] [-i] [-d] <fs-image>\n" \
+	"       sqfs [-m mode] [-q depth] [-H] [-e] [-j threads] <fs-image>"\
+	" /path/to/dir/\n" \
+	"       sqfs [-m mode] [-q depth] [-H] [-e] [-j threads] <fs-image>"\
+	" /path/to/file\n" \
+	"       sqfs [-m mode] [-q depth] [-H] [-x dest] [-j threads]"\
+	" <fs-image> [/path]\n" \
 	"\n" \
 	"Tool to analyze the content of a SquashFS image\n" \
 	"\n" \
@@ -36,23 +37,38 @@
 	"       -d: Dumps the contents of a SquashFS image's directory table\n"\
 	"       -e: Dumps the contents of a SquashFS image's"\
 	" file or directory.\n\t   For directories, end path with '/'.\n"\
+	"       -x: Extracts a SquashFS image's file or directory tree"\
+	" into\n\t   the directory 'dest' (the whole image by default)\n"\
+	"       -j: Number of threads decompressing a file's data blocks,"\
+	" or\n\t   extracting files with -x (default: 1)\n"\
+	"       -m: How to read the image: mmap, pread, memory or uring"\
+	" (default:\n\t   mmap for files, pread for devices, memory for"\
+	" pipes)\n"\
+	"       -q: Number of data block reads in flight per thread with"\
+	" -m uring\n\t   (default: 32)\n"\
+	"       -H: Backs the image mapping and the block buffers with huge"\
+	" pages\n"\
 	"\n" \
 	"Parameters:\n" \
-	"       <fs-image>: Path to the filesystem image\n" \
+	"       <fs-image>: Path to the filesystem image, - for stdin\n" \
 	"\n"
 
 int main(int argc, char *argv[])
 {
 	bool dump_sb = false, dump_inodes = false, dump_dir_table = false,
 	     dump_entry = false;
-	char *fs_image = NULL;
-	void *file_mapping;
-	struct stat sb;
+	enum sqfs_image_mode mode = SQFS_IMAGE_AUTO;
+	char *fs_image = NULL, *path = "/", *dest = NULL;
+	struct sqfs_image img;
 	int opt, ret;
-	int fd;
+	int threads = 1;
+	int depth = 0;
+	unsigned int flags = 0;
+
+	sqfs_print_errors = true;
 
 	/* Command line parsing */
-	while ((opt = getopt(argc, argv, "hside")) != -1) {
+	while ((opt = getopt(argc, argv, "hsidej:x:m:q:H")) != -1) {
 		switch (opt) {
 		case 'h':
 			printf(SQFS_USAGE);
@@ -69,109 +85,96 @@ int main(int argc, char *argv[])
 		case 'e':
 			dump_entry = true;
 			break;
+		case 'x':
+			dest = optarg;
+			break;
+		case 'm':
+			if (!strcmp(optarg, "mmap")) {
+				mode = SQFS_IMAGE_MMAP;
+			} else if (!strcmp(optarg, "pread")) {
+				mode = SQFS_IMAGE_PREAD;
+			} else if (!strcmp(optarg, "memory")) {
+				mode = SQFS_IMAGE_MEMORY;
+			} else if (!strcmp(optarg, "uring")) {
+				mode = SQFS_IMAGE_URING;
+			} else {
+				printf(SQFS_USAGE);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			if (threads < 1) {
+				printf(SQFS_USAGE);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'q':
+			depth = atoi(optarg);
+			if (depth < 1 || depth > 4096) {
+				printf(SQFS_USAGE);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'H':
+			flags |= SQFS_IMAGE_HUGE_PAGES;
+			break;
 		default:
 			break;
 		}
 	}
 
 	/*
-	 * Incorrect argument number. For -e option (dump_entry): argc must be
-	 * 3 or 4.
+	 * Incorrect argument number. For -e and -x options: the image may be
+	 * followed by a path.
 	 */
-	if ((optind != (argc - 1)) && !dump_entry) {
+	if ((optind != (argc - 1)) && !dump_entry && !dest) {
 		printf(SQFS_USAGE);
 		return EXIT_FAILURE;
-	} else if (dump_entry) {
-		if (!(argc == 3 || argc == 4)) {
+	} else if (dump_entry || dest) {
+		if (!(argc - optind == 1 || argc - optind == 2)) {
 			printf(SQFS_USAGE);
 			return EXIT_FAILURE;
 		}
 	}
 
 	fs_image = argv[optind];
-	fd = open(fs_image, O_RDONLY);
-	if (fd < 0) {
-		printf("No such file or directory\n");
+	ret = sqfs_image_open(&img, fs_image, mode, flags);
+	if (ret)
 		return EXIT_FAILURE;
-	}
 
-	/* Memory mapping of SquashFS image */
-	fstat(fd, &sb);
-	file_mapping = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (file_mapping == MAP_FAILED) {
-		fprintf(stderr, "Error: file could not be read\n");
-		return -errno;
-	}
+	if (depth && img.queue_depth)
+		img.queue_depth = depth;
 
 	/* Command execution */
 	if (dump_sb) {
-		ret = sqfs_dump_sblk(file_mapping);
-		if (ret) {
-			errno = ret;
-			munmap(file_mapping, sb.st_size);
-			close(fd);
-			return EXIT_FAILURE;
-		}
-
-		munmap(file_mapping, sb.st_size);
-		close(fd);
-
-		return EXIT_SUCCESS;
-	}
-
-	if (dump_inodes) {
-		ret = sqfs_dump_inode_table(file_mapping);
-		if (ret) {
-			errno = ret;
-			munmap(file_mapping, sb.st_size);
-			close(fd);
-			return EXIT_FAILURE;
-		}
-
-		munmap(file_mapping, sb.st_size);
-		close(fd);
-
-		return EXIT_SUCCESS;
-	}
-
-	if (dump_dir_table) {
-		ret = sqfs_dump_directory_table(file_mapping);
-		if (ret) {
-			errno = ret;
-			munmap(file_mapping, sb.st_size);
-			close(fd);
-			return EXIT_FAILURE;
-		}
-
-		munmap(file_mapping, sb.st_size);
-		close(fd);
-
-		return EXIT_SUCCESS;
-	}
-
-	if (dump_entry) {
+		ret = sqfs_dump_sblk(&img);
+	} else if (dump_inodes) {
+		ret = sqfs_dump_inode_table(&img);
+	} else if (dump_dir_table) {
+		ret = sqfs_dump_directory_table(&img);
+	} else if (dump_entry) {
 		/* If no path is given, presume it is intended to be root */
-		if (argc == 3)
-			ret = sqfs_dump_entry(file_mapping, "/");
-		else
-			ret = sqfs_dump_entry(file_mapping, argv[3]);
-		if (ret) {
-			errno = ret;
-			munmap(file_mapping, sb.st_size);
-			close(fd);
-			return EXIT_FAILURE;
-		}
+		if (argc - optind == 2)
+			path = argv[optind + 1];
 
-		munmap(file_mapping, sb.st_size);
-		close(fd);
+		ret = sqfs_dump_entry(&img, path, threads);
+	} else if (dest) {
+		if (argc - optind == 2)
+			path = argv[optind + 1];
 
-		return EXIT_SUCCESS;
+		ret = sqfs_extract(&img, path, dest, threads);
+	} else {
+		/* Wrong command */
+		printf(SQFS_USAGE);
+		ret = -EINVAL;
 	}
 
-	/* Wrong command */
-	printf(SQFS_USAGE);
-	munmap(file_mapping, sb.st_size);
-	close(fd);
+	sqfs_image_close(&img);
+	if (ret) {
+		errno = -ret;
+		return EXIT_FAILURE;
+	}
 
-	return EXIT_FAILURE;
+	return EXIT_SUCCESS;
 }
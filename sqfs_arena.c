@@ -0,0 +1,121 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Bootlin
+ *
+ * Author: Joao Marcos Costa <joaomarcos.costa@bootlin.com>
+ *
+ * sqfs_arena.c: bump allocator released in one shot
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sqfs_arena.h"
+#include "sqfs_utils.h"
+
+/* Enough for any type, as malloc(3) guarantees */
+#define SQFS_ARENA_ALIGN 16
+
+void sqfs_arena_init(struct sqfs_arena *arena, size_t chunk_size)
+{
+	memset(arena, 0, sizeof(*arena));
+	arena->chunk_size = chunk_size;
+}
+
+void sqfs_arena_free(struct sqfs_arena *arena)
+{
+	struct sqfs_arena_chunk *chunk, *next;
+
+	printd("Arena: %lu bytes allocated\n", arena->allocated);
+
+	for (chunk = arena->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+
+	arena->chunks = NULL;
+	arena->allocated = 0;
+}
+
+/* Take 'size' bytes from the free end of 'chunk', NULL if they do not fit */
+static void *sqfs_arena_carve(struct sqfs_arena_chunk *chunk, size_t size)
+{
+	uintptr_t start, end;
+
+	start = ALIGN((uintptr_t)chunk->data + chunk->used, SQFS_ARENA_ALIGN);
+	end = (uintptr_t)chunk->data + chunk->size;
+	if (start > end || size > end - start)
+		return NULL;
+
+	chunk->used = start + size - (uintptr_t)chunk->data;
+
+	return (void *)start;
+}
+
+void *sqfs_arena_alloc(struct sqfs_arena *arena, size_t size)
+{
+	struct sqfs_arena_chunk *chunk;
+	size_t chunk_size;
+	void *p;
+
+	if (arena->chunks) {
+		p = sqfs_arena_carve(arena->chunks, size);
+		if (p) {
+			arena->allocated += size;
+			return p;
+		}
+	}
+
+	/*
+	 * Large allocations get a chunk of their own, kept behind the one
+	 * being filled so that its free space is not wasted.
+	 */
+	chunk_size = size + SQFS_ARENA_ALIGN;
+	if (chunk_size < arena->chunk_size)
+		chunk_size = arena->chunk_size;
+
+	chunk = malloc(sizeof(*chunk) + chunk_size);
+	if (!chunk) {
+		printe("%s: Memory allocation error.\n", __func__);
+		return NULL;
+	}
+
+	chunk->size = chunk_size;
+	chunk->used = 0;
+	if (arena->chunks && chunk_size > arena->chunk_size) {
+		chunk->next = arena->chunks->next;
+		arena->chunks->next = chunk;
+	} else {
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+	}
+
+	arena->allocated += size;
+
+	return sqfs_arena_carve(chunk, size);
+}
+
+void *sqfs_arena_zalloc(struct sqfs_arena *arena, size_t size)
+{
+	void *p;
+
+	p = sqfs_arena_alloc(arena, size);
+	if (p)
+		memset(p, 0, size);
+
+	return p;
+}
+
+char *sqfs_arena_strdup(struct sqfs_arena *arena, const char *s)
+{
+	size_t len = strlen(s) + 1;
+	char *p;
+
+	p = sqfs_arena_alloc(arena, len);
+	if (p)
+		memcpy(p, s, len);
+
+	return p;
+}
@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2020 Bootlin
+ *
+ * Author: Joao Marcos Costa <joaomarcos.costa@bootlin.com>
+ *
+ * sqfs_arena.h:	bump allocator released in one shot, included at
+ *			sqfs_filesystem.h
+ */
+
+#ifndef SQFS_ARENA_H
+#define SQFS_ARENA_H
+
+#include <stddef.h>
+
+/* Default size of the chunks the allocations are carved from */
+#define SQFS_ARENA_CHUNK (64 << 10)
+
+struct sqfs_arena_chunk {
+	struct sqfs_arena_chunk *next;
+	size_t size, used;
+	unsigned char data[];
+};
+
+/*
+ * Memory which lives as long as an operation: allocations are never freed one
+ * by one, so error paths only have to release the whole arena. Not thread-safe.
+ */
+struct sqfs_arena {
+	/* The chunk being filled comes first */
+	struct sqfs_arena_chunk *chunks;
+	size_t chunk_size;
+	/* Bytes handed out, for debugging */
+	size_t allocated;
+};
+
+void sqfs_arena_init(struct sqfs_arena *arena, size_t chunk_size);
+void sqfs_arena_free(struct sqfs_arena *arena);
+void *sqfs_arena_alloc(struct sqfs_arena *arena, size_t size);
+void *sqfs_arena_zalloc(struct sqfs_arena *arena, size_t size);
+char *sqfs_arena_strdup(struct sqfs_arena *arena, const char *s);
+
+#endif /* SQFS_ARENA_H */
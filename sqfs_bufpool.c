@@ -0,0 +1,319 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Bootlin
+ *
+ * Author: Joao Marcos Costa <joaomarcos.costa@bootlin.com>
+ *
+ * sqfs_bufpool.c: block-sized buffers recycled without taking a lock
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sqfs_bufpool.h"
+#include "sqfs_image.h"
+#include "sqfs_utils.h"
+
+/* Keeps the buffers aligned on cache lines */
+#define SQFS_BUF_HEADER 64
+
+/* Stored in front of each buffer */
+struct sqfs_buf_header {
+	uint32_t index;
+	/* Next buffer in the depot, plus one: only valid while in the depot */
+	uint32_t next;
+};
+
+struct sqfs_buf_cache {
+	struct sqfs_buf_pool *pool;
+	int count;
+	uint32_t indexes[SQFS_BUF_CACHE];
+};
+
+static struct sqfs_buf_header *sqfs_buf_header(struct sqfs_buf_pool *pool,
+					       uint32_t index)
+{
+	struct sqfs_buf_table *table;
+	unsigned char *slab;
+
+	table = __atomic_load_n(&pool->table, __ATOMIC_ACQUIRE);
+	slab = table->slabs[index / pool->slab_buffers];
+
+	return (void *)(slab + (index % pool->slab_buffers) * pool->stride);
+}
+
+/*
+ * Push the chain of buffers going from 'first' to 'last' through their 'next'
+ * links at once
+ */
+static void sqfs_buf_depot_push(struct sqfs_buf_pool *pool, uint32_t first,
+				uint32_t last)
+{
+	struct sqfs_buf_header *h = sqfs_buf_header(pool, last);
+	uint64_t old, new;
+
+	old = __atomic_load_n(&pool->depot, __ATOMIC_RELAXED);
+	do {
+		__atomic_store_n(&h->next, (uint32_t)old, __ATOMIC_RELAXED);
+		new = (((old >> 32) + 1) << 32) | (first + 1);
+	} while (!__atomic_compare_exchange_n(&pool->depot, &old, new, true,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+}
+
+/* Push 'indexes[0..count)', the first one ending on top */
+static void sqfs_buf_depot_push_array(struct sqfs_buf_pool *pool,
+				      const uint32_t *indexes, int count)
+{
+	int k;
+
+	for (k = 0; k < count - 1; k++)
+		__atomic_store_n(&sqfs_buf_header(pool, indexes[k])->next,
+				 indexes[k + 1] + 1, __ATOMIC_RELAXED);
+
+	sqfs_buf_depot_push(pool, indexes[0], indexes[count - 1]);
+}
+
+/*
+ * Pop the buffer on top of the depot, -1 if it is empty. Its 'next' link may
+ * be rewritten by the thread which popped it meanwhile, but the counter then
+ * changed as well, so the stale link is never installed.
+ */
+static int64_t sqfs_buf_depot_pop(struct sqfs_buf_pool *pool)
+{
+	uint64_t old, new;
+	uint32_t top, next;
+
+	old = __atomic_load_n(&pool->depot, __ATOMIC_ACQUIRE);
+	do {
+		top = (uint32_t)old;
+		if (!top)
+			return -1;
+
+		next = __atomic_load_n(&sqfs_buf_header(pool, top - 1)->next,
+				       __ATOMIC_RELAXED);
+		new = (((old >> 32) + 1) << 32) | next;
+	} while (!__atomic_compare_exchange_n(&pool->depot, &old, new, true,
+					      __ATOMIC_ACQUIRE,
+					      __ATOMIC_ACQUIRE));
+
+	return top - 1;
+}
+
+static struct sqfs_buf_table *sqfs_buf_table_alloc(unsigned int capacity)
+{
+	struct sqfs_buf_table *table;
+
+	table = calloc(1, sizeof(*table) + capacity * sizeof(*table->slabs));
+	if (table)
+		table->capacity = capacity;
+
+	return table;
+}
+
+/* Called with 'grow_lock' held */
+static int sqfs_buf_table_grow(struct sqfs_buf_pool *pool)
+{
+	struct sqfs_buf_table *table, *old = pool->table;
+
+	/* Buffer indexes, plus one, must fit in 32 bits */
+	if (old->capacity > UINT32_MAX / 2 / pool->slab_buffers) {
+		printe("%s: Too many buffers in use.\n", __func__);
+		return -ENOSPC;
+	}
+
+	table = sqfs_buf_table_alloc(2 * old->capacity);
+	if (!table) {
+		printe("%s: Memory allocation error.\n", __func__);
+		return -ENOMEM;
+	}
+
+	memcpy(table->slabs, old->slabs, old->capacity * sizeof(*old->slabs));
+	table->prev = old;
+	__atomic_store_n(&pool->table, table, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/* Add a slab of buffers to the depot, unless another thread just did */
+static int sqfs_buf_pool_grow(struct sqfs_buf_pool *pool)
+{
+	size_t size = pool->slab_buffers * pool->stride;
+	struct sqfs_buf_header *h;
+	unsigned char *slab;
+	unsigned int k;
+	uint32_t first;
+	int ret = 0;
+
+	pthread_mutex_lock(&pool->grow_lock);
+	if ((uint32_t)__atomic_load_n(&pool->depot, __ATOMIC_RELAXED))
+		goto unlock;
+
+	if (pool->slab_count == pool->table->capacity) {
+		ret = sqfs_buf_table_grow(pool);
+		if (ret)
+			goto unlock;
+	}
+
+	slab = pool->huge_pages ? sqfs_huge_alloc(size) : malloc(size);
+	if (!slab) {
+		printe("%s: Memory allocation error.\n", __func__);
+		ret = -ENOMEM;
+		goto unlock;
+	}
+
+	/* Published to the other threads by the release of the push */
+	pool->table->slabs[pool->slab_count] = slab;
+	first = pool->slab_count * pool->slab_buffers;
+	for (k = 0; k < pool->slab_buffers; k++) {
+		h = (void *)(slab + k * pool->stride);
+		h->index = first + k;
+		h->next = first + k + 2;
+	}
+
+	pool->slab_count++;
+	sqfs_buf_depot_push(pool, first, first + pool->slab_buffers - 1);
+
+unlock:
+	pthread_mutex_unlock(&pool->grow_lock);
+
+	return ret;
+}
+
+/* Give the buffers cached by a thread back to the depot */
+static void sqfs_buf_cache_flush(void *arg)
+{
+	struct sqfs_buf_cache *cache = arg;
+
+	if (cache->count)
+		sqfs_buf_depot_push_array(cache->pool, cache->indexes,
+					  cache->count);
+	free(cache);
+}
+
+int sqfs_buf_pool_init(struct sqfs_buf_pool *pool, size_t size,
+		       bool huge_pages)
+{
+	int ret;
+
+	memset(pool, 0, sizeof(*pool));
+	pool->size = size;
+	pool->stride = SQFS_BUF_HEADER + ALIGN(size, SQFS_BUF_HEADER);
+	pool->huge_pages = huge_pages;
+
+	/* Use every buffer which fits in the huge pages backing a slab */
+	pool->slab_buffers = SQFS_BUF_SLAB;
+	if (huge_pages)
+		pool->slab_buffers = ALIGN(SQFS_BUF_SLAB * pool->stride,
+					   SQFS_HUGE_PAGE_SIZE) / pool->stride;
+
+	pool->table = sqfs_buf_table_alloc(SQFS_BUF_TABLE);
+	if (!pool->table) {
+		printe("%s: Memory allocation error.\n", __func__);
+		return -ENOMEM;
+	}
+
+	ret = -pthread_key_create(&pool->cache, sqfs_buf_cache_flush);
+	if (ret) {
+		free(pool->table);
+		pool->table = NULL;
+		return ret;
+	}
+
+	pthread_mutex_init(&pool->grow_lock, NULL);
+
+	return 0;
+}
+
+/*
+ * Every buffer must have been put back, and the other threads which used the
+ * pool must have exited.
+ */
+void sqfs_buf_pool_free(struct sqfs_buf_pool *pool)
+{
+	struct sqfs_buf_table *table, *prev;
+	struct sqfs_buf_cache *cache;
+	unsigned int k;
+
+	if (!pool->table)
+		return;
+
+	printd("Buffer pool: %u buffers of %lu bytes\n",
+	       pool->slab_count * pool->slab_buffers, pool->size);
+
+	cache = pthread_getspecific(pool->cache);
+	if (cache) {
+		pthread_setspecific(pool->cache, NULL);
+		free(cache);
+	}
+
+	pthread_key_delete(pool->cache);
+	pthread_mutex_destroy(&pool->grow_lock);
+
+	for (k = 0; k < pool->slab_count; k++) {
+		if (pool->huge_pages)
+			sqfs_huge_free(pool->table->slabs[k],
+				       pool->slab_buffers * pool->stride);
+		else
+			free(pool->table->slabs[k]);
+	}
+
+	for (table = pool->table; table; table = prev) {
+		prev = table->prev;
+		free(table);
+	}
+	memset(pool, 0, sizeof(*pool));
+}
+
+unsigned char *sqfs_buf_get(struct sqfs_buf_pool *pool)
+{
+	struct sqfs_buf_cache *cache;
+	int64_t index;
+
+	cache = pthread_getspecific(pool->cache);
+	if (cache && cache->count) {
+		index = cache->indexes[--cache->count];
+	} else {
+		while ((index = sqfs_buf_depot_pop(pool)) < 0)
+			if (sqfs_buf_pool_grow(pool))
+				return NULL;
+	}
+
+	return (unsigned char *)sqfs_buf_header(pool, index) +
+		SQFS_BUF_HEADER;
+}
+
+void sqfs_buf_put(struct sqfs_buf_pool *pool, unsigned char *buf)
+{
+	struct sqfs_buf_header *h;
+	struct sqfs_buf_cache *cache;
+
+	if (!buf)
+		return;
+
+	h = (void *)(buf - SQFS_BUF_HEADER);
+	cache = pthread_getspecific(pool->cache);
+	if (!cache) {
+		cache = malloc(sizeof(*cache));
+		if (!cache || pthread_setspecific(pool->cache, cache)) {
+			free(cache);
+			sqfs_buf_depot_push(pool, h->index, h->index);
+			return;
+		}
+
+		cache->pool = pool;
+		cache->count = 0;
+	}
+
+	/* Hand half of the cache over to the other threads */
+	if (cache->count == SQFS_BUF_CACHE) {
+		cache->count -= SQFS_BUF_CACHE / 2;
+		sqfs_buf_depot_push_array(pool, cache->indexes + cache->count,
+					  SQFS_BUF_CACHE / 2);
+	}
+
+	cache->indexes[cache->count++] = h->index;
+}
@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2020 Bootlin
+ *
+ * Author: Joao Marcos Costa <joaomarcos.costa@bootlin.com>
+ *
+ * sqfs_bufpool.h:	pool of block-sized buffers shared by the threads,
+ *			included at sqfs_filesystem.h
+ */
+
+#ifndef SQFS_BUFPOOL_H
+#define SQFS_BUFPOOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Buffers allocated at once when the pool runs dry */
+#define SQFS_BUF_SLAB 8
+/* Initial capacity of the slab table, doubled whenever it is full */
+#define SQFS_BUF_TABLE 16
+/* Free buffers a thread keeps for itself before returning them */
+#define SQFS_BUF_CACHE 4
+
+/*
+ * Buffers of 'size' bytes which are never given back to the allocator before
+ * sqfs_buf_pool_free(). Each thread first reuses the buffers it released,
+ * then takes them from the depot, a lock-free stack shared by all threads:
+ * the lock is only taken to grow the pool.
+ *
+ * Buffers are known by their index in the slabs, so that the top of the depot
+ * and a counter, bumped by every update, fit in a single 64-bit word.
+ */
+struct sqfs_buf_table {
+	/* Table replaced by this one, freed along with the pool */
+	struct sqfs_buf_table *prev;
+	unsigned int capacity;
+	unsigned char *slabs[];
+};
+
+struct sqfs_buf_pool {
+	size_t size;
+	/* Distance between two buffers of a slab, header included */
+	size_t stride;
+	bool huge_pages;
+	/* (counter << 32) | (index of the top buffer + 1), 0 if empty */
+	uint64_t depot;
+	/*
+	 * Only ever appended to, under 'grow_lock'. A full table is copied to
+	 * a larger one, the threads which still look up buffers in the former
+	 * one finding the same slabs there.
+	 */
+	struct sqfs_buf_table *table;
+	unsigned int slab_count, slab_buffers;
+	pthread_mutex_t grow_lock;
+	/* Buffers cached by each thread, given back to the depot at exit */
+	pthread_key_t cache;
+};
+
+int sqfs_buf_pool_init(struct sqfs_buf_pool *pool, size_t size,
+		       bool huge_pages);
+void sqfs_buf_pool_free(struct sqfs_buf_pool *pool);
+unsigned char *sqfs_buf_get(struct sqfs_buf_pool *pool);
+void sqfs_buf_put(struct sqfs_buf_pool *pool, unsigned char *buf);
+
+#endif /* SQFS_BUFPOOL_H */
@@ -0,0 +1,1032 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Bootlin
+ *
+ * Author: Joao Marcos Costa <joaomarcos.costa@bootlin.com>
+ *
+ * sqfs_data.c: read the data blocks and fragments of regular files
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sqfs_filesystem.h"
+#include "sqfs_utils.h"
+#include "sqfs_decompressor.h"
+
+/* Max. number of fragment entries in a metadata block is 512 */
+#define MAX_ENTRIES 512
+#define SQUASHFS_FRAGMENT_INDEX(A) ((A) / MAX_ENTRIES)
+#define SQUASHFS_FRAGMENT_INDEX_OFFSET(A) ((A) % MAX_ENTRIES)
+#define SQUASHFS_UNCOMPRESSED_DATA 0x0002
+#define COMPRESSED_FRAGMENT_BLOCK(A) (!((A) & BIT(24)))
+#define FRAGMENT_BLOCK_SIZE(A) ((A) & GENMASK(23, 0))
+
+/*
+ * Retrieves the fragment block entry describing fragment 'inode_fragment'.
+ * The metadata blocks holding the fragment table are read through the
+ * metadata cache, since consecutive files often share the same block.
+ */
+int sqfs_frag_lookup(struct sqfs_ctx *ctx, uint32_t inode_fragment,
+		     struct fragment_block_entry *e)
+{
+	struct fragment_block_entry *entries;
+	struct squashfs_super_block *sblk;
+	uint64_t start_block;
+	int block, offset;
+	size_t size;
+	int ret;
+
+	sblk = ctx->sblk;
+	if (inode_fragment >= sblk->fragments) {
+		printe("%s: Invalid fragment index.\n", __func__);
+		return -EINVAL;
+	}
+
+	block = SQUASHFS_FRAGMENT_INDEX(inode_fragment);
+	offset = SQUASHFS_FRAGMENT_INDEX_OFFSET(inode_fragment);
+
+	/*
+	 * Get the start offset of the metadata block that contains the right
+	 * fragment_block_entry, from the fragment index table
+	 */
+	ret = sqfs_image_read(ctx->image, &start_block, sizeof(start_block),
+			      sblk->fragment_table_start +
+			      block * sizeof(start_block));
+	if (ret)
+		return ret;
+
+	entries = sqfs_meta_cache_get(&ctx->meta_cache, start_block, &size);
+	if (!entries || (offset + 1) * sizeof(*entries) > size)
+		return -EINVAL;
+
+	*e = entries[offset];
+
+	printd("Fragment entry:\n");
+	printd("Start: 0x%016lx\n", e->start);
+
+	if (COMPRESSED_FRAGMENT_BLOCK(e->size))
+		printd("Compressed fragment block\n");
+	else
+		printd("Uncompressed fragment block\n");
+
+	printd("Fragment block on-disk size: %lu\n",
+	       FRAGMENT_BLOCK_SIZE(e->size));
+
+	return 0;
+}
+
+int sqfs_file_init(struct sqfs_ctx *ctx, union squashfs_inode *i,
+		   struct sqfs_file *file)
+{
+	memset(file, 0, sizeof(*file));
+
+	switch (i->base->inode_type) {
+	case SQUASHFS_REG_TYPE:
+		file->file_size = i->reg->file_size;
+		file->start_block = i->reg->start_block;
+		file->block_list = i->reg->block_list;
+		file->fragment = i->reg->fragment;
+		file->frag_offset = i->reg->offset;
+		break;
+	case SQUASHFS_LREG_TYPE:
+		file->file_size = i->lreg->file_size;
+		file->start_block = i->lreg->start_block;
+		file->block_list = i->lreg->block_list;
+		file->fragment = i->lreg->fragment;
+		file->frag_offset = i->lreg->offset;
+		break;
+	default:
+		printe("Not a regular file.\n");
+		return -EINVAL;
+	}
+
+	file->block_count = sqfs_count_blocks(file->file_size, file->fragment,
+					      ctx->sblk->block_size);
+
+	return 0;
+}
+
+/*
+ * Get 'size' bytes stored uncompressed at 'offset': straight from the image if
+ * it is in memory, otherwise read into 'buffer'.
+ */
+static int sqfs_read_raw(struct sqfs_ctx *ctx, uint64_t offset, size_t size,
+			 unsigned char *buffer, unsigned char **data)
+{
+	if (size > ctx->sblk->block_size) {
+		printe("%s: Invalid block size.\n", __func__);
+		return -EINVAL;
+	}
+
+	if (!ctx->image->base) {
+		*data = buffer;
+		return sqfs_image_read(ctx->image, buffer, size, offset);
+	}
+
+	*data = (unsigned char *)sqfs_image_view(ctx->image, offset, size);
+
+	return *data ? 0 : -EIO;
+}
+
+/*
+ * Get the content of the fragment block described by 'e': compressed blocks
+ * are decompressed into 'buffer' (block_size bytes), uncompressed ones are
+ * used in place. '*data' and '*size' describe the whole fragment block.
+ */
+int sqfs_read_fragment(struct sqfs_ctx *ctx, struct sqfs_decomp *decomp,
+		       struct fragment_block_entry *e, unsigned char *buffer,
+		       unsigned char **data, size_t *size)
+{
+	const void *src;
+	int ret;
+
+	if (!COMPRESSED_FRAGMENT_BLOCK(e->size)) {
+		*size = FRAGMENT_BLOCK_SIZE(e->size);
+
+		return sqfs_read_raw(ctx, e->start, *size, buffer, data);
+	}
+
+	src = sqfs_image_view(ctx->image, e->start,
+			      FRAGMENT_BLOCK_SIZE(e->size));
+	if (!src)
+		return -EIO;
+
+	*size = ctx->sblk->block_size;
+	ret = sqfs_decompress(decomp, buffer, size, src,
+			      FRAGMENT_BLOCK_SIZE(e->size));
+	if (ret) {
+		printe("Error while decompressing fragment block.\n");
+		return ret;
+	}
+
+	printd("Uncompressed fragment block size: %ld\n", *size);
+	*data = buffer;
+
+	return 0;
+}
+
+int sqfs_frag_cache_init(struct sqfs_frag_cache *cache, struct sqfs_ctx *ctx,
+			 int capacity)
+{
+	int k;
+
+	memset(cache, 0, sizeof(*cache));
+	if (capacity <= 0)
+		return -EINVAL;
+
+	cache->ctx = ctx;
+	cache->capacity = capacity;
+
+	/* Keep the load factor of the hash table below 1 */
+	for (cache->bucket_count = 1; cache->bucket_count < capacity;
+	     cache->bucket_count <<= 1)
+		;
+
+	cache->entries = calloc(capacity, sizeof(*cache->entries));
+	cache->buckets = calloc(cache->bucket_count, sizeof(*cache->buckets));
+	if (!cache->entries || !cache->buckets) {
+		printe("%s: Memory allocation error.\n", __func__);
+		free(cache->entries);
+		free(cache->buckets);
+		return -ENOMEM;
+	}
+
+	/* Every entry starts unused, in the LRU list */
+	for (k = 0; k < capacity; k++) {
+		cache->entries[k].fragment = SQFS_FRAG_NONE;
+		cache->entries[k].prev = k ? &cache->entries[k - 1] : NULL;
+		cache->entries[k].next = k < capacity - 1 ?
+			&cache->entries[k + 1] : NULL;
+	}
+
+	cache->head = &cache->entries[0];
+	cache->tail = &cache->entries[capacity - 1];
+	pthread_mutex_init(&cache->lock, NULL);
+	pthread_cond_init(&cache->cond, NULL);
+
+	return 0;
+}
+
+void sqfs_frag_cache_free(struct sqfs_frag_cache *cache)
+{
+	int k;
+
+	if (!cache->entries)
+		return;
+
+	printd("Fragment cache: %lu hits, %lu misses\n", cache->hits,
+	       cache->misses);
+
+	for (k = 0; k < cache->capacity; k++)
+		sqfs_buf_put(&cache->ctx->buffers, cache->entries[k].buffer);
+
+	pthread_cond_destroy(&cache->cond);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache->entries);
+	free(cache->buckets);
+	memset(cache, 0, sizeof(*cache));
+}
+
+static int sqfs_frag_cache_hash(struct sqfs_frag_cache *cache,
+				uint32_t fragment)
+{
+	return fragment & (cache->bucket_count - 1);
+}
+
+static void sqfs_frag_cache_unlink(struct sqfs_frag_cache *cache,
+				   struct sqfs_frag_cache_entry *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		cache->head = e->next;
+
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		cache->tail = e->prev;
+
+	e->prev = NULL;
+	e->next = NULL;
+}
+
+static void sqfs_frag_cache_push(struct sqfs_frag_cache *cache,
+				 struct sqfs_frag_cache_entry *e)
+{
+	e->prev = NULL;
+	e->next = cache->head;
+	if (cache->head)
+		cache->head->prev = e;
+	cache->head = e;
+	if (!cache->tail)
+		cache->tail = e;
+}
+
+static void sqfs_frag_cache_unhash(struct sqfs_frag_cache *cache,
+				   struct sqfs_frag_cache_entry *e)
+{
+	struct sqfs_frag_cache_entry **p;
+
+	if (e->fragment == SQFS_FRAG_NONE)
+		return;
+
+	p = &cache->buckets[sqfs_frag_cache_hash(cache, e->fragment)];
+	while (*p && *p != e)
+		p = &(*p)->hnext;
+	if (*p)
+		*p = e->hnext;
+	e->hnext = NULL;
+	e->fragment = SQFS_FRAG_NONE;
+}
+
+/*
+ * Fill a newly claimed entry: called with the lock held, which is dropped
+ * while decompressing so that other fragments can be read meanwhile.
+ */
+static int sqfs_frag_cache_fill(struct sqfs_frag_cache *cache,
+				struct sqfs_decomp *decomp,
+				struct sqfs_frag_cache_entry *e)
+{
+	struct fragment_block_entry frag_entry;
+	int ret;
+
+	/* The fragment table is read through the (unlocked) metadata cache */
+	ret = sqfs_frag_lookup(cache->ctx, e->fragment, &frag_entry);
+	if (ret)
+		return ret;
+
+	if (!e->buffer) {
+		e->buffer = sqfs_buf_get(&cache->ctx->buffers);
+		if (!e->buffer)
+			return -ENOMEM;
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+	ret = sqfs_read_fragment(cache->ctx, decomp, &frag_entry, e->buffer,
+				 &e->data, &e->size);
+	pthread_mutex_lock(&cache->lock);
+
+	return ret;
+}
+
+/*
+ * Get a referenced entry holding fragment block 'fragment', decompressing it
+ * with 'decomp' on a miss. If another thread is already decompressing it, wait
+ * for it instead of doing the work twice. A thread must not hold more than one
+ * entry at a time, or it could wait forever for a free one.
+ */
+int sqfs_frag_cache_get(struct sqfs_frag_cache *cache,
+			struct sqfs_decomp *decomp, uint32_t fragment,
+			struct sqfs_frag_cache_entry **entry)
+{
+	struct sqfs_frag_cache_entry *e;
+	int bucket, ret;
+
+	pthread_mutex_lock(&cache->lock);
+	bucket = sqfs_frag_cache_hash(cache, fragment);
+	for (;;) {
+		for (e = cache->buckets[bucket]; e; e = e->hnext)
+			if (e->fragment == fragment)
+				break;
+
+		if (e || cache->tail)
+			break;
+
+		/* All entries are in use by other threads: wait for one */
+		pthread_cond_wait(&cache->cond, &cache->lock);
+	}
+
+	if (e) {
+		cache->hits++;
+		if (!e->refs++)
+			sqfs_frag_cache_unlink(cache, e);
+
+		while (!e->ready)
+			pthread_cond_wait(&cache->cond, &cache->lock);
+
+		ret = e->error;
+		pthread_mutex_unlock(&cache->lock);
+		if (ret) {
+			sqfs_frag_cache_put(cache, e);
+			return ret;
+		}
+
+		*entry = e;
+
+		return 0;
+	}
+
+	cache->misses++;
+	e = cache->tail;
+	sqfs_frag_cache_unlink(cache, e);
+	sqfs_frag_cache_unhash(cache, e);
+	e->fragment = fragment;
+	e->refs = 1;
+	e->ready = false;
+	e->error = 0;
+	e->hnext = cache->buckets[bucket];
+	cache->buckets[bucket] = e;
+
+	ret = sqfs_frag_cache_fill(cache, decomp, e);
+	e->error = ret;
+	e->ready = true;
+	pthread_cond_broadcast(&cache->cond);
+	pthread_mutex_unlock(&cache->lock);
+
+	if (ret) {
+		sqfs_frag_cache_put(cache, e);
+		return ret;
+	}
+
+	*entry = e;
+
+	return 0;
+}
+
+void sqfs_frag_cache_put(struct sqfs_frag_cache *cache,
+			 struct sqfs_frag_cache_entry *e)
+{
+	pthread_mutex_lock(&cache->lock);
+	if (!--e->refs) {
+		/* Do not keep failed entries around */
+		if (e->error)
+			sqfs_frag_cache_unhash(cache, e);
+
+		sqfs_frag_cache_push(cache, e);
+		pthread_cond_broadcast(&cache->cond);
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * Get the content of a data block, described by the block list 'entry', from
+ * its on-disk bytes 'src'. Blocks stored uncompressed (bit 24 set) are not
+ * copied: '*data' then points to 'src'. Otherwise the block is decompressed,
+ * or zero-filled if sparse ('src' is not used then), into 'buffer'.
+ */
+int sqfs_decode_datablock(struct sqfs_ctx *ctx, struct sqfs_decomp *decomp,
+			  uint32_t entry, const void *src,
+			  unsigned char *buffer, unsigned char **data,
+			  size_t *size)
+{
+	int ret;
+
+	if (!COMPRESSED_DATABLOCK(entry) && !IS_SPARSE_BLOCK(entry)) {
+		*data = (unsigned char *)src;
+		*size = DATABLOCK_SIZE(entry);
+
+		return 0;
+	}
+
+	*data = buffer;
+	*size = ctx->sblk->block_size;
+	if (IS_SPARSE_BLOCK(entry)) {
+		memset(buffer, 0, *size);
+		return 0;
+	}
+
+	ret = sqfs_decompress(decomp, buffer, size, src, DATABLOCK_SIZE(entry));
+	if (ret)
+		printe("Error while decompressing data blk.\n");
+
+	return ret;
+}
+
+/*
+ * Get the content of the data block stored at 'offset', described by the
+ * block list 'entry'. Raw blocks are not copied if the image is in memory,
+ * '*data' then points into the image. Otherwise the block is read,
+ * decompressed, or zero-filled if sparse, into 'buffer'.
+ */
+int sqfs_read_datablock(struct sqfs_ctx *ctx, struct sqfs_decomp *decomp,
+			uint64_t offset, uint32_t entry, unsigned char *buffer,
+			unsigned char **data, size_t *size)
+{
+	const void *src = NULL;
+
+	if (!COMPRESSED_DATABLOCK(entry) && !IS_SPARSE_BLOCK(entry)) {
+		*size = DATABLOCK_SIZE(entry);
+
+		return sqfs_read_raw(ctx, offset, *size, buffer, data);
+	}
+
+	if (!IS_SPARSE_BLOCK(entry)) {
+		src = sqfs_image_view(ctx->image, offset, DATABLOCK_SIZE(entry));
+		if (!src)
+			return -EIO;
+	}
+
+	return sqfs_decode_datablock(ctx, decomp, entry, src, buffer, data,
+				     size);
+}
+
+int sqfs_block_reader_init(struct sqfs_block_reader *r, struct sqfs_ctx *ctx,
+			   bool skip_raw)
+{
+	struct sqfs_image *img = ctx->image;
+	int k, ret;
+
+	memset(r, 0, sizeof(*r));
+	r->ctx = ctx;
+	r->skip_raw = skip_raw;
+	r->depth = 1;
+
+	if (img->queue_depth > 0 && img->fd >= 0) {
+		ret = sqfs_uring_init(&r->ring, img->queue_depth);
+		if (!ret) {
+			r->async = true;
+			r->depth = img->queue_depth;
+		} else {
+			printd("io_uring unavailable (%d), reading blocks synchronously\n",
+			       ret);
+		}
+	}
+
+	r->offsets = malloc(r->depth * sizeof(*r->offsets));
+	r->sizes = malloc(r->depth * sizeof(*r->sizes));
+	r->results = malloc(r->depth * sizeof(*r->results));
+	r->ready = malloc(r->depth * sizeof(*r->ready));
+	if (r->async)
+		r->buffers = calloc(r->depth, sizeof(*r->buffers));
+
+	if (!r->offsets || !r->sizes || !r->results || !r->ready ||
+	    (r->async && !r->buffers)) {
+		printe("%s: Memory allocation error.\n", __func__);
+		sqfs_block_reader_free(r);
+		return -ENOMEM;
+	}
+
+	/* The pool reports why it cannot provide a buffer */
+	for (k = 0; r->buffers && k < r->depth; k++) {
+		r->buffers[k] = sqfs_buf_get(&ctx->buffers);
+		if (!r->buffers[k]) {
+			sqfs_block_reader_free(r);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+static void sqfs_block_reader_complete(struct sqfs_block_reader *r, int slot,
+				       int res)
+{
+	unsigned char *buffer = r->buffers[slot];
+
+	/* Finish short reads synchronously */
+	if (res >= 0 && res < r->sizes[slot])
+		res = sqfs_image_read(r->ctx->image, buffer + res,
+				      r->sizes[slot] - res,
+				      r->offsets[slot] + res);
+
+	r->results[slot] = res < 0 ? res : 0;
+	r->ready[slot] = true;
+	r->inflight--;
+}
+
+/* Wait for any read in flight to complete */
+static int sqfs_block_reader_reap(struct sqfs_block_reader *r)
+{
+	uint64_t slot;
+	int ret, res;
+
+	ret = sqfs_uring_wait(&r->ring, &slot, &res);
+	if (ret)
+		return ret;
+
+	sqfs_block_reader_complete(r, slot, res);
+
+	return 0;
+}
+
+/* Ask the kernel to fetch the blocks ahead of the reads */
+static void sqfs_block_reader_advise(struct sqfs_block_reader *r)
+{
+	uint64_t end = r->next_offset + SQFS_IMAGE_READAHEAD;
+
+	if (end > r->end_offset)
+		end = r->end_offset;
+
+	/* In steps of half the window, rather than block by block */
+	if (end <= r->advised ||
+	    (end < r->end_offset &&
+	     end - r->advised < SQFS_IMAGE_READAHEAD / 2))
+		return;
+
+	sqfs_image_advise(r->ctx->image, r->advised, end - r->advised,
+			  SQFS_ADVICE_WILLNEED);
+	r->advised = end;
+}
+
+/* Ask the kernel to drop the data read and not released yet */
+static void sqfs_block_reader_flush(struct sqfs_block_reader *r)
+{
+	if (r->drop_end > r->drop_start && r->ctx->image->drop_behind)
+		sqfs_image_advise(r->ctx->image, r->drop_start,
+				  r->drop_end - r->drop_start,
+				  SQFS_ADVICE_DONTNEED);
+
+	r->drop_start = r->drop_end;
+}
+
+/* The data of the range before 'offset' will not be read again */
+static void sqfs_block_reader_release(struct sqfs_block_reader *r,
+				      uint64_t offset)
+{
+	if (offset > r->drop_end)
+		r->drop_end = offset;
+
+	if (r->drop_end - r->drop_start >= SQFS_IMAGE_DROP_BEHIND)
+		sqfs_block_reader_flush(r);
+}
+
+/* Queue the next blocks to read, as long as there are free slots */
+static int sqfs_block_reader_fill(struct sqfs_block_reader *r)
+{
+	struct sqfs_image *img = r->ctx->image;
+	uint32_t block_size = r->ctx->sblk->block_size;
+	uint64_t offset;
+	uint32_t entry;
+	int slot, ret;
+	size_t size;
+
+	while (r->count < r->depth && r->next_block < r->end_block) {
+		entry = r->block_list[r->next_block++];
+		offset = r->next_offset;
+		size = DATABLOCK_SIZE(entry);
+		r->next_offset += size;
+
+		if (IS_SPARSE_BLOCK(entry) ||
+		    (r->skip_raw && !COMPRESSED_DATABLOCK(entry)))
+			continue;
+
+		slot = (r->head + r->count++) % r->depth;
+		r->offsets[slot] = offset;
+		r->sizes[slot] = size;
+		r->results[slot] = 0;
+		r->ready[slot] = true;
+		if (!r->async)
+			continue;
+
+		if (size > block_size || offset > img->size ||
+		    size > img->size - offset) {
+			printe("%s: Invalid data block.\n", __func__);
+			r->results[slot] = -EIO;
+			continue;
+		}
+
+		ret = sqfs_uring_read(&r->ring, img->fd, r->buffers[slot],
+				      size, offset, slot);
+		if (ret) {
+			r->results[slot] = ret;
+			continue;
+		}
+
+		r->ready[slot] = false;
+		r->inflight++;
+		__atomic_add_fetch(&img->reads, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&img->bytes_read, size, __ATOMIC_RELAXED);
+	}
+
+	sqfs_block_reader_advise(r);
+
+	return r->async ? sqfs_uring_submit(&r->ring) : 0;
+}
+
+/* Wait for the reads in flight, their buffers are about to be reused */
+static int sqfs_block_reader_drain(struct sqfs_block_reader *r)
+{
+	int ret;
+
+	while (r->inflight) {
+		ret = sqfs_block_reader_reap(r);
+		if (ret)
+			return ret;
+	}
+
+	r->head = 0;
+	r->count = 0;
+	r->held = false;
+
+	return 0;
+}
+
+void sqfs_block_reader_free(struct sqfs_block_reader *r)
+{
+	int k;
+
+	if (r->block_list) {
+		sqfs_block_reader_release(r, r->end_offset);
+		sqfs_block_reader_flush(r);
+	}
+
+	sqfs_block_reader_drain(r);
+	if (r->async)
+		sqfs_uring_free(&r->ring);
+
+	free(r->offsets);
+	free(r->sizes);
+	free(r->results);
+	free(r->ready);
+	for (k = 0; r->buffers && k < r->depth; k++)
+		sqfs_buf_put(&r->ctx->buffers, r->buffers[k]);
+	free(r->buffers);
+	memset(r, 0, sizeof(*r));
+}
+
+/*
+ * Read 'count' data blocks of 'file' from block 'first', stored at 'offset'.
+ * Blocks still queued from a previous range are dropped.
+ */
+int sqfs_block_reader_start(struct sqfs_block_reader *r,
+			    struct sqfs_file *file, uint64_t first,
+			    uint64_t count, uint64_t offset)
+{
+	uint64_t j;
+	int ret;
+
+	ret = sqfs_block_reader_drain(r);
+	if (ret)
+		return ret;
+
+	/* The previous range is done with, keep it if this one follows */
+	if (r->block_list)
+		sqfs_block_reader_release(r, r->end_offset);
+	if (offset != r->drop_end) {
+		sqfs_block_reader_flush(r);
+		r->drop_start = offset;
+		r->drop_end = offset;
+	}
+
+	r->block_list = file->block_list;
+	r->next_block = first;
+	r->end_block = first + count;
+	r->next_offset = offset;
+
+	r->end_offset = offset;
+	for (j = first; j < r->end_block; j++)
+		r->end_offset += DATABLOCK_SIZE(r->block_list[j]);
+	r->advised = offset;
+
+	return sqfs_block_reader_fill(r);
+}
+
+/*
+ * Return the on-disk content of the next block to read. It remains valid
+ * until the next call.
+ */
+int sqfs_block_reader_next(struct sqfs_block_reader *r, const void **src,
+			   size_t *size)
+{
+	int slot, ret;
+
+	/* The previous block is not needed anymore */
+	if (r->held) {
+		sqfs_block_reader_release(r, r->offsets[r->head] +
+					  r->sizes[r->head]);
+		r->head = (r->head + 1) % r->depth;
+		r->count--;
+		r->held = false;
+	}
+
+	ret = sqfs_block_reader_fill(r);
+	if (ret)
+		return ret;
+
+	if (!r->count)
+		return -EINVAL;
+
+	slot = r->head;
+	while (!r->ready[slot]) {
+		ret = sqfs_block_reader_reap(r);
+		if (ret)
+			return ret;
+	}
+
+	r->held = true;
+	*size = r->sizes[slot];
+	if (!r->async) {
+		*src = sqfs_image_view(r->ctx->image, r->offsets[slot], *size);
+		return *src ? 0 : -EIO;
+	}
+
+	*src = r->buffers[slot];
+
+	return r->results[slot];
+}
+
+/*
+ * Data blocks decompressed in parallel. Block j goes to slot j % window
+ * and is written by the calling thread, in order, which then releases
+ * the slot: at most 'window' blocks are held in memory at any time.
+ */
+struct sqfs_block_pool {
+	struct sqfs_ctx *ctx;
+	struct sqfs_file *file;
+	/* Absolute offset of each data block, from the block list */
+	uint64_t *offsets;
+	unsigned char **buffers;
+	/* Content of the block held by each slot, in its buffer or the image */
+	unsigned char **data;
+	size_t *lengths;
+	bool *ready;
+	int window;
+	/* Next block to decompress, and number of blocks written */
+	uint64_t next, written;
+	int error;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void *sqfs_block_worker(void *arg)
+{
+	struct sqfs_block_pool *pool = arg;
+	struct sqfs_decomp decomp;
+	unsigned char *data;
+	size_t size;
+	uint64_t j;
+	int ret, slot;
+
+	/* Decompression contexts are per thread */
+	ret = sqfs_decomp_dup(&decomp, &pool->ctx->decomp);
+
+	pthread_mutex_lock(&pool->lock);
+	if (ret)
+		pool->error = ret;
+
+	for (;;) {
+		while (!pool->error && pool->next < pool->file->block_count &&
+		       pool->next >= pool->written + pool->window)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+
+		if (pool->error || pool->next >= pool->file->block_count)
+			break;
+
+		j = pool->next++;
+		slot = j % pool->window;
+		pthread_mutex_unlock(&pool->lock);
+
+		ret = sqfs_read_datablock(pool->ctx, &decomp, pool->offsets[j],
+					  pool->file->block_list[j],
+					  pool->buffers[slot], &data, &size);
+
+		pthread_mutex_lock(&pool->lock);
+		if (ret) {
+			pool->error = ret;
+		} else {
+			pool->data[slot] = data;
+			pool->lengths[slot] = size;
+			pool->ready[slot] = true;
+		}
+
+		pthread_cond_broadcast(&pool->cond);
+	}
+
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+	sqfs_decomp_free(&decomp);
+
+	return NULL;
+}
+
+static int sqfs_write_blocks_parallel(struct sqfs_ctx *ctx,
+				      struct sqfs_file *file,
+				      struct sqfs_sink *sink)
+{
+	struct sqfs_block_pool pool;
+	pthread_t *threads;
+	int k, nthreads, slot, ret = 0;
+	uint64_t j;
+
+	nthreads = ctx->threads;
+	if (nthreads > file->block_count)
+		nthreads = file->block_count;
+
+	memset(&pool, 0, sizeof(pool));
+	pool.ctx = ctx;
+	pool.file = file;
+	pool.window = 2 * nthreads;
+	pool.offsets = malloc(file->block_count * sizeof(*pool.offsets));
+	pool.buffers = calloc(pool.window, sizeof(*pool.buffers));
+	pool.data = calloc(pool.window, sizeof(*pool.data));
+	pool.lengths = calloc(pool.window, sizeof(*pool.lengths));
+	pool.ready = calloc(pool.window, sizeof(*pool.ready));
+	threads = calloc(nthreads, sizeof(*threads));
+	if (!pool.offsets || !pool.buffers || !pool.data || !pool.lengths ||
+	    !pool.ready || !threads) {
+		printe("%s: Memory allocation error.\n", __func__);
+		ret = -ENOMEM;
+		goto free_pool;
+	}
+
+	for (k = 0; k < pool.window; k++) {
+		pool.buffers[k] = sqfs_buf_get(&ctx->buffers);
+		if (!pool.buffers[k]) {
+			ret = -ENOMEM;
+			goto free_pool;
+		}
+	}
+
+	/* Prefix sum of the on-disk block sizes */
+	pool.offsets[0] = file->start_block;
+	for (j = 1; j < file->block_count; j++)
+		pool.offsets[j] = pool.offsets[j - 1] +
+			DATABLOCK_SIZE(file->block_list[j - 1]);
+
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.cond, NULL);
+
+	/* Go on with fewer workers if some of them cannot be created */
+	for (k = 0; k < nthreads; k++)
+		if (pthread_create(&threads[k], NULL, sqfs_block_worker, &pool))
+			break;
+
+	if (!k) {
+		printe("%s: Cannot create thread.\n", __func__);
+		ret = -EAGAIN;
+		goto destroy_pool;
+	}
+
+	pthread_mutex_lock(&pool.lock);
+
+	for (j = 0; j < file->block_count && !pool.error; j++) {
+		slot = j % pool.window;
+		while (!pool.ready[slot] && !pool.error)
+			pthread_cond_wait(&pool.cond, &pool.lock);
+
+		if (pool.error)
+			break;
+
+		/* The slot cannot be reused before 'written' moves on */
+		pthread_mutex_unlock(&pool.lock);
+		ret = sqfs_sink_write(sink, pool.data[slot],
+				      pool.lengths[slot]);
+		pthread_mutex_lock(&pool.lock);
+
+		if (ret)
+			pool.error = ret;
+
+		pool.ready[slot] = false;
+		pool.written++;
+		pthread_cond_broadcast(&pool.cond);
+	}
+
+	ret = pool.error;
+	pthread_cond_broadcast(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+
+	while (k--)
+		pthread_join(threads[k], NULL);
+
+destroy_pool:
+	pthread_cond_destroy(&pool.cond);
+	pthread_mutex_destroy(&pool.lock);
+free_pool:
+	free(threads);
+	free(pool.ready);
+	free(pool.lengths);
+	free(pool.data);
+	for (k = 0; pool.buffers && k < pool.window; k++)
+		sqfs_buf_put(&ctx->buffers, pool.buffers[k]);
+	free(pool.buffers);
+	free(pool.offsets);
+
+	return ret;
+}
+
+/*
+ * Stream the content of 'file' to 'sink', one block at a time: a single
+ * block-sized buffer is used for every data block and for the fragment, so
+ * memory usage does not depend on the file size. With ctx->threads > 1,
+ * the data blocks of compressed images are decompressed in parallel.
+ * Otherwise, they are read ahead on io_uring images.
+ */
+int sqfs_write_file(struct sqfs_ctx *ctx, struct sqfs_file *file,
+		    struct sqfs_sink *sink)
+{
+	struct squashfs_super_block *sblk = ctx->sblk;
+	struct sqfs_frag_cache_entry *frag;
+	struct sqfs_block_reader reader;
+	unsigned char *block, *data;
+	uint64_t i, j, offset, tail;
+	const void *src;
+	size_t size;
+	int ret = 0;
+
+	/* The pool reports why it cannot provide a buffer */
+	block = sqfs_buf_get(&ctx->buffers);
+	if (!block)
+		return -ENOMEM;
+
+	printd("Number of data blocks %lu\n", file->block_count);
+	if (ctx->threads > 1 && file->block_count > 1 &&
+	    !(sblk->flags & SQUASHFS_UNCOMPRESSED_DATA)) {
+		ret = sqfs_write_blocks_parallel(ctx, file, sink);
+		if (ret)
+			goto free_block;
+
+		/* Only the fragment is left */
+		j = file->block_count;
+	} else {
+		j = 0;
+	}
+
+	offset = file->start_block;
+	for (i = 0; i < j; i++)
+		offset += DATABLOCK_SIZE(file->block_list[i]);
+
+	ret = sqfs_block_reader_init(&reader, ctx, false);
+	if (ret)
+		goto free_block;
+
+	ret = sqfs_block_reader_start(&reader, file, j, file->block_count - j,
+				      offset);
+	for (; !ret && j < file->block_count; j++) {
+		src = NULL;
+		if (!IS_SPARSE_BLOCK(file->block_list[j])) {
+			ret = sqfs_block_reader_next(&reader, &src, &size);
+			if (ret)
+				break;
+		}
+
+		ret = sqfs_decode_datablock(ctx, &ctx->decomp,
+					    file->block_list[j], src, block,
+					    &data, &size);
+		if (!ret)
+			ret = sqfs_sink_write(sink, data, size);
+	}
+
+	sqfs_block_reader_free(&reader);
+	if (ret || !IS_FRAGMENTED(file->fragment))
+		goto free_block;
+
+	ret = sqfs_frag_cache_get(&ctx->frag_cache, &ctx->decomp,
+				  file->fragment, &frag);
+	if (ret)
+		goto free_block;
+
+	/* The tail end must fit in the fragment block */
+	tail = file->file_size - file->block_count * sblk->block_size;
+	if (file->frag_offset > frag->size ||
+	    tail > frag->size - file->frag_offset) {
+		printe("%s: Invalid fragment offset.\n", __func__);
+		ret = -EINVAL;
+	} else {
+		ret = sqfs_sink_write(sink, frag->data + file->frag_offset,
+				      tail);
+	}
+
+	sqfs_frag_cache_put(&ctx->frag_cache, frag);
+
+free_block:
+	sqfs_buf_put(&ctx->buffers, block);
+
+	return ret;
+}
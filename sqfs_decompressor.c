@@ -18,8 +18,22 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <strings.h>
 #include <zlib.h>
 
+#if defined(CONFIG_SQFS_LZMA) || defined(CONFIG_SQFS_XZ)
+#include <lzma.h>
+#endif
+#ifdef CONFIG_SQFS_LZO
+#include <lzo/lzo1x.h>
+#endif
+#ifdef CONFIG_SQFS_LZ4
+#include <lz4.h>
+#endif
+#ifdef CONFIG_SQFS_ZSTD
+#include <zstd.h>
+#endif
+
 #include "sqfs_decompressor.h"
 #include "sqfs_utils.h"
 
@@ -28,38 +42,376 @@
  * https://dr-emann.github.io/squashfs/#superblock
  */
 
-/* For now, sqfs_decompress supports only zlib compression. */
-int sqfs_decompress(void *dest, size_t *dest_len, const void *source,
-		    size_t source_len)
+static int sqfs_zlib_init(struct sqfs_decomp *d)
+{
+	if (d->has_opts && (d->opts.gzip->window_size < 8 ||
+			    d->opts.gzip->window_size > MAX_WBITS)) {
+		printe("Invalid zlib window size: %u\n",
+		       d->opts.gzip->window_size);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int sqfs_zlib_create(struct sqfs_decomp *d)
+{
+	z_stream *strm;
+
+	strm = calloc(1, sizeof(*strm));
+	if (!strm)
+		return -ENOMEM;
+
+	if (inflateInit2(strm, d->has_opts ? d->opts.gzip->window_size :
+			 MAX_WBITS) != Z_OK) {
+		free(strm);
+		return -ENOMEM;
+	}
+
+	d->stream = strm;
+
+	return 0;
+}
+
+static void sqfs_zlib_destroy(struct sqfs_decomp *d)
+{
+	inflateEnd(d->stream);
+	free(d->stream);
+}
+
+static int sqfs_zlib_decompress(struct sqfs_decomp *d, void *dest,
+				size_t *dest_len, const void *source,
+				size_t source_len)
 {
+	z_stream *strm = d->stream;
 	int ret;
 
-	ret = uncompress(dest, dest_len, source, source_len);
+	/* Keep the inflate state and window allocated by sqfs_zlib_create() */
+	ret = inflateReset(strm);
+	if (ret != Z_OK)
+		return -EINVAL;
+
+	strm->next_in = (Bytef *)source;
+	strm->avail_in = source_len;
+	strm->next_out = dest;
+	strm->avail_out = *dest_len;
+
+	ret = inflate(strm, Z_FINISH);
+	*dest_len = strm->total_out;
+
 	switch (ret) {
+	case Z_STREAM_END:
+		printd("Decompression OK.\n");
+		return 0;
 	case Z_BUF_ERROR:
 		printd("Error: 'dest' buffer is not large enough.\n");
-		break;
-	case Z_DATA_ERROR:
-		printd("Error: corrupted compressed data.\n");
-		break;
+		return -ENOSPC;
 	case Z_MEM_ERROR:
 		printd("Error: insufficient memory.\n");
-		break;
-	case Z_OK:
-		printd("Decompression OK.\n");
-		break;
+		return -ENOMEM;
+	default:
+		printd("Error: corrupted compressed data.\n");
+		return -EINVAL;
+	}
+}
+
+#if defined(CONFIG_SQFS_LZMA) || defined(CONFIG_SQFS_XZ)
+static int sqfs_lzma_create(struct sqfs_decomp *d)
+{
+	lzma_stream init = LZMA_STREAM_INIT;
+	lzma_stream *strm;
+
+	strm = malloc(sizeof(*strm));
+	if (!strm)
+		return -ENOMEM;
+
+	*strm = init;
+	d->stream = strm;
+
+	return 0;
+}
+
+static void sqfs_lzma_destroy(struct sqfs_decomp *d)
+{
+	lzma_end(d->stream);
+	free(d->stream);
+}
+
+/*
+ * Run a decoder set up on 'strm' over a whole block. Setting a decoder up
+ * again on the same stream reuses its memory, the dictionary included, as
+ * long as the dictionary size does not change.
+ */
+static int sqfs_lzma_run(lzma_stream *strm, void *dest, size_t *dest_len,
+			 const void *source, size_t source_len)
+{
+	lzma_ret ret;
+
+	strm->next_in = source;
+	strm->avail_in = source_len;
+	strm->next_out = dest;
+	strm->avail_out = *dest_len;
+
+	ret = lzma_code(strm, LZMA_FINISH);
+	*dest_len = strm->total_out;
+
+	if (ret != LZMA_STREAM_END || strm->avail_in) {
+		printd("LZMA error: %d\n", ret);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+#endif
+
+#ifdef CONFIG_SQFS_LZMA
+/* Legacy LZMA streams, using the .lzma ("LZMA alone") format */
+static int sqfs_lzma_decompress(struct sqfs_decomp *d, void *dest,
+				size_t *dest_len, const void *source,
+				size_t source_len)
+{
+	if (lzma_alone_decoder(d->stream, UINT64_MAX) != LZMA_OK)
+		return -ENOMEM;
+
+	return sqfs_lzma_run(d->stream, dest, dest_len, source, source_len);
+}
+#endif
+
+#ifdef CONFIG_SQFS_XZ
+static int sqfs_xz_init(struct sqfs_decomp *d)
+{
+	uint32_t dictionary_size;
+	int n;
+
+	if (!d->has_opts)
+		return 0;
+
+	/* The dictionary size is either 2^n or 2^n + 2^(n + 1) */
+	dictionary_size = d->opts.xz->dictionary_size;
+	n = ffs(dictionary_size) - 1;
+	if (n < 0 || (dictionary_size != (1U << n) &&
+		      dictionary_size != (1U << n) + (1U << (n + 1)))) {
+		printe("Invalid XZ dictionary size: %u\n", dictionary_size);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int sqfs_xz_decompress(struct sqfs_decomp *d, void *dest,
+			      size_t *dest_len, const void *source,
+			      size_t source_len)
+{
+	/* BCJ (executable) filters are described in the stream itself */
+	if (lzma_stream_decoder(d->stream, UINT64_MAX, 0) != LZMA_OK)
+		return -ENOMEM;
+
+	return sqfs_lzma_run(d->stream, dest, dest_len, source, source_len);
+}
+#endif
+
+#ifdef CONFIG_SQFS_LZO
+/* Values of lzo_opts.algorithm, all of them LZO1X variants */
+#define SQFS_LZO1X_999 4
+
+static int sqfs_lzo_init(struct sqfs_decomp *d)
+{
+	if (lzo_init() != LZO_E_OK)
+		return -EINVAL;
+
+	if (d->has_opts && d->opts.lzo->algorithm > SQFS_LZO1X_999) {
+		printe("Unsupported LZO algorithm: %u\n",
+		       d->opts.lzo->algorithm);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int sqfs_lzo_decompress(struct sqfs_decomp *d, void *dest,
+			       size_t *dest_len, const void *source,
+			       size_t source_len)
+{
+	lzo_uint out_len = *dest_len;
+	int ret;
+
+	ret = lzo1x_decompress_safe(source, source_len, dest, &out_len, NULL);
+	*dest_len = out_len;
+	if (ret != LZO_E_OK) {
+		printd("LZO error: %d\n", ret);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+#endif
+
+#ifdef CONFIG_SQFS_LZ4
+/* The only LZ4 format version produced by mksquashfs */
+#define SQFS_LZ4_LEGACY 1
+
+static int sqfs_lz4_init(struct sqfs_decomp *d)
+{
+	if (d->has_opts && d->opts.lz4->version != SQFS_LZ4_LEGACY) {
+		printe("Unsupported LZ4 version: %u\n", d->opts.lz4->version);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int sqfs_lz4_decompress(struct sqfs_decomp *d, void *dest,
+			       size_t *dest_len, const void *source,
+			       size_t source_len)
+{
+	int ret;
+
+	ret = LZ4_decompress_safe(source, dest, source_len, *dest_len);
+	if (ret < 0) {
+		printd("LZ4 error: %d\n", ret);
+		return -EINVAL;
 	}
 
-	return ret;
+	*dest_len = ret;
+
+	return 0;
+}
+#endif
+
+#ifdef CONFIG_SQFS_ZSTD
+static int sqfs_zstd_create(struct sqfs_decomp *d)
+{
+	d->stream = ZSTD_createDCtx();
+
+	return d->stream ? 0 : -ENOMEM;
+}
+
+static void sqfs_zstd_destroy(struct sqfs_decomp *d)
+{
+	ZSTD_freeDCtx(d->stream);
+}
+
+static int sqfs_zstd_decompress(struct sqfs_decomp *d, void *dest,
+				size_t *dest_len, const void *source,
+				size_t source_len)
+{
+	size_t ret;
+
+	ret = ZSTD_decompressDCtx(d->stream, dest, *dest_len, source,
+				  source_len);
+	if (ZSTD_isError(ret)) {
+		printd("ZSTD error: %s\n", ZSTD_getErrorName(ret));
+		return -EINVAL;
+	}
+
+	*dest_len = ret;
+
+	return 0;
+}
+#endif
+
+/* zlib is always available, the other backends are optional */
+static const struct sqfs_decompressor sqfs_decompressors[] = {
+	{ ZLIB, "zlib", sqfs_zlib_init, sqfs_zlib_create, sqfs_zlib_destroy,
+	  sqfs_zlib_decompress },
+#ifdef CONFIG_SQFS_LZMA
+	{ LZMA, "lzma", NULL, sqfs_lzma_create, sqfs_lzma_destroy,
+	  sqfs_lzma_decompress },
+#endif
+#ifdef CONFIG_SQFS_LZO
+	{ LZO, "lzo", sqfs_lzo_init, NULL, NULL, sqfs_lzo_decompress },
+#endif
+#ifdef CONFIG_SQFS_XZ
+	{ XZ, "xz", sqfs_xz_init, sqfs_lzma_create, sqfs_lzma_destroy,
+	  sqfs_xz_decompress },
+#endif
+#ifdef CONFIG_SQFS_LZ4
+	{ LZ4, "lz4", sqfs_lz4_init, NULL, NULL, sqfs_lz4_decompress },
+#endif
+#ifdef CONFIG_SQFS_ZSTD
+	{ ZSTD, "zstd", NULL, sqfs_zstd_create, sqfs_zstd_destroy,
+	  sqfs_zstd_decompress },
+#endif
+};
+
+const struct sqfs_decompressor *sqfs_find_decompressor(int compression)
+{
+	int k;
+
+	for (k = 0; k < ARRAY_SIZE(sqfs_decompressors); k++)
+		if (sqfs_decompressors[k].id == compression)
+			return &sqfs_decompressors[k];
+
+	return NULL;
+}
+
+/*
+ * Select the decompressor matching the superblock's 'compression' field.
+ * 'opts' is NULL when the image does not carry compression options.
+ */
+int sqfs_decomp_init(struct sqfs_decomp *d, int compression,
+		     union sqfs_compression_opts *opts)
+{
+	int ret;
+
+	memset(d, 0, sizeof(*d));
+	d->ops = sqfs_find_decompressor(compression);
+	if (!d->ops) {
+		printe("Compression type %d is not supported by this build.\n",
+		       compression);
+		return -EOPNOTSUPP;
+	}
+
+	if (opts) {
+		d->opts = *opts;
+		d->has_opts = true;
+	}
+
+	printd("Decompressor: %s\n", d->ops->name);
+
+	if (d->ops->init) {
+		ret = d->ops->init(d);
+		if (ret)
+			return ret;
+	}
+
+	return d->ops->create ? d->ops->create(d) : 0;
+}
+
+/* Set up a context sharing the settings of 'src', but with its own state */
+int sqfs_decomp_dup(struct sqfs_decomp *dest, const struct sqfs_decomp *src)
+{
+	*dest = *src;
+	dest->stream = NULL;
+
+	return dest->ops->create ? dest->ops->create(dest) : 0;
+}
+
+void sqfs_decomp_free(struct sqfs_decomp *d)
+{
+	if (d->ops && d->ops->destroy && d->stream)
+		d->ops->destroy(d);
+
+	d->stream = NULL;
+}
+
+/*
+ * Decompress 'source_len' bytes into 'dest', whose size is given by
+ * '*dest_len'. On success, '*dest_len' is set to the uncompressed size.
+ */
+int sqfs_decompress(struct sqfs_decomp *d, void *dest, size_t *dest_len,
+		    const void *source, size_t source_len)
+{
+	return d->ops->decompress(d, dest, dest_len, source, source_len);
 }
 
 int sqfs_fill_compression_opts(union sqfs_compression_opts *opts,
-			       int compression, void *file_mapping)
+			       int compression, void *image_head)
 {
-	/* Metadata block reading */
+	/* Metadata block following the superblock */
 	void *metadata;
 
-	metadata = file_mapping + SUPER_BLOCK_SIZE + HEADER_SIZE;
+	metadata = image_head + SUPER_BLOCK_SIZE + HEADER_SIZE;
 
 	switch (compression) {
 	case ZLIB:
@@ -90,7 +442,7 @@ int sqfs_dump_compression_opts(int compression,
 			       union sqfs_compression_opts *opts)
 {
 	if (!opts) {
-		printf("Error while dumping compression options\n");
+		printe("Error while dumping compression options\n");
 		return -EINVAL;
 	}
 	printf(" --- COMPRESSION OPTIONS ---\n");
@@ -11,6 +11,8 @@
 #ifndef SQFS_DECOMPRESSOR_H
 #define SQFS_DECOMPRESSOR_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 /* LZMA does not support any compression options */
@@ -50,12 +52,48 @@ union sqfs_compression_opts {
 
 enum squashfs_compression_type;
 
+struct sqfs_decomp;
+
+/*
+ * Decompressor backend, selected from the superblock's 'compression' field.
+ * 'init' checks the compression options (if any) and may be NULL.
+ * 'create' allocates the backend's stream state, which is kept across
+ * blocks and released by 'destroy'. Both are NULL for stateless backends.
+ */
+struct sqfs_decompressor {
+	int id;
+	const char *name;
+	int (*init)(struct sqfs_decomp *d);
+	int (*create)(struct sqfs_decomp *d);
+	void (*destroy)(struct sqfs_decomp *d);
+	int (*decompress)(struct sqfs_decomp *d, void *dest, size_t *dest_len,
+			  const void *source, size_t source_len);
+};
+
+/*
+ * A decompression context is not thread-safe: each thread decompressing
+ * blocks owns its context, obtained with sqfs_decomp_dup().
+ */
+struct sqfs_decomp {
+	const struct sqfs_decompressor *ops;
+	/* Only valid when 'has_opts' is set */
+	union sqfs_compression_opts opts;
+	bool has_opts;
+	/* Backend state reused from one block to the next */
+	void *stream;
+};
+
 int sqfs_fill_compression_opts(union sqfs_compression_opts *opts,
-			       int compression, void *file_mapping);
+			       int compression, void *image_head);
 int sqfs_dump_compression_opts(int compression,
 			       union sqfs_compression_opts *opts);
 
-int sqfs_decompress(void *dest, size_t *dest_len, const void *source,
-		    size_t source_len);
+const struct sqfs_decompressor *sqfs_find_decompressor(int compression);
+int sqfs_decomp_init(struct sqfs_decomp *d, int compression,
+		     union sqfs_compression_opts *opts);
+int sqfs_decomp_dup(struct sqfs_decomp *dest, const struct sqfs_decomp *src);
+void sqfs_decomp_free(struct sqfs_decomp *d);
+int sqfs_decompress(struct sqfs_decomp *d, void *dest, size_t *dest_len,
+		    const void *source, size_t source_len);
 
 #endif /* SQFS_DECOMPRESSOR_H */
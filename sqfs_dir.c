@@ -8,7 +8,6 @@
  */
 
 #include <errno.h>
-#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,7 +15,6 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <time.h>
-#include <zlib.h>
 
 #include "sqfs_filesystem.h"
 #include "sqfs_utils.h"
@@ -24,7 +22,6 @@
 
 #define MAJOR_NUMBER_BITMASK GENMASK(15, 8)
 #define MINOR_NUMBER_BITMASK GENMASK(7, 0)
-#define LREG_INODE_MIN_SIZE 56
 /*
  * A directory entry object has a fixed length of 8 bytes, corresponding to its
  * first four members, plus the size of the entry name, which is equal to
@@ -33,22 +30,268 @@
 #define ENTRY_BASE_LENGTH 8
 #define EMPTY_FILE_SIZE 3
 
-/* Returns directory inode offset into the directory table */
-int sqfs_get_dir_offset(union squashfs_inode *i)
+/*
+ * Retrieve where the listing (headers and entries) of a directory inode starts
+ * in the directory table, and its size in bytes.
+ */
+static int sqfs_get_dir_location(union squashfs_inode *i,
+				 uint32_t *start_block, uint16_t *offset,
+				 uint32_t *size)
 {
+	uint32_t file_size;
+
 	switch (i->base->inode_type) {
 	case SQUASHFS_DIR_TYPE:
-		return (i->dir->start_block * METADATA_BLOCK_SIZE) +
-			i->dir->offset;
+		*start_block = i->dir->start_block;
+		*offset = i->dir->offset;
+		file_size = i->dir->file_size;
+		break;
 	case SQUASHFS_LDIR_TYPE:
-		return (i->ldir->start_block * METADATA_BLOCK_SIZE) +
-			i->ldir->offset;
+		*start_block = i->ldir->start_block;
+		*offset = i->ldir->offset;
+		file_size = i->ldir->file_size;
+		break;
 	default:
-		printf("Error: this is not a directory.\n");
+		printe("Error: this is not a directory.\n");
+		return -ENOTDIR;
+	}
+
+	/* 'file_size' is 3 bytes larger than the actual listing */
+	*size = file_size > EMPTY_FILE_SIZE ? file_size - EMPTY_FILE_SIZE : 0;
+
+	return 0;
+}
+
+int sqfs_dir_iter_init(struct sqfs_dir_iter *iter,
+		       struct sqfs_meta_table *dir_table,
+		       union squashfs_inode *dir)
+{
+	uint32_t start_block, size;
+	uint16_t offset;
+	int64_t start;
+	int ret;
+
+	memset(iter, 0, sizeof(*iter));
+	ret = sqfs_get_dir_location(dir, &start_block, &offset, &size);
+	if (ret)
+		return ret;
+
+	iter->dir_table = dir_table;
+	if (!size)
+		return 0;
+
+	start = sqfs_meta_table_pos(dir_table, start_block, offset);
+	if (start < 0)
 		return -EINVAL;
+
+	iter->pos = start;
+	iter->end = start + size;
+
+	return 0;
+}
+
+/*
+ * Move to the next entry of the directory, reading a new header whenever the
+ * previous one's entries are exhausted. Names point into the directory table
+ * and are not null-terminated. Returns 1 if an entry was found, 0 at the end
+ * of the listing and a negative value if the listing is corrupted.
+ */
+int sqfs_dir_iter_next(struct sqfs_dir_iter *iter, struct sqfs_dirent *dirent)
+{
+	struct directory_entry *entry;
+
+	if (!iter->remaining) {
+		if (iter->pos >= iter->end)
+			return 0;
+
+		iter->header = sqfs_meta_table_at(iter->dir_table, iter->pos,
+						  sizeof(*iter->header));
+		if (!iter->header || iter->header->count >= SQUASHFS_DIR_COUNT)
+			return -EINVAL;
+
+		/*
+		 * 'count' is the number of entries following the header minus
+		 * one, 'start' the inode table block where their inodes are
+		 * stored and 'inode_number' the base their numbers are
+		 * relative to.
+		 */
+		printd("Header: %u entries, inode block 0x%08x, base %u\n",
+		       iter->header->count + 1, iter->header->start,
+		       iter->header->inode_number);
+		iter->remaining = iter->header->count + 1;
+		iter->pos += sizeof(*iter->header);
+	}
+
+	entry = sqfs_meta_table_at(iter->dir_table, iter->pos,
+				   ENTRY_BASE_LENGTH);
+	if (!entry)
+		return -EINVAL;
+
+	entry = sqfs_meta_table_at(iter->dir_table, iter->pos,
+				   ENTRY_BASE_LENGTH + entry->name_size + 1);
+	if (!entry)
+		return -EINVAL;
+
+	iter->pos += ENTRY_BASE_LENGTH + entry->name_size + 1;
+	iter->remaining--;
+	if (iter->pos > iter->end)
+		return -EINVAL;
+
+	dirent->name = entry->name;
+	dirent->name_length = entry->name_size + 1;
+	dirent->type = entry->type;
+	dirent->inode_number = iter->header->inode_number + entry->inode_offset;
+	dirent->inode_ref = ((uint64_t)iter->header->start << 16) |
+		entry->offset;
+
+	return 1;
+}
+
+uint32_t sqfs_get_parent_inode(union squashfs_inode *i)
+{
+	switch (i->base->inode_type) {
+	case SQUASHFS_DIR_TYPE:
+		return i->dir->parent_inode;
+	case SQUASHFS_LDIR_TYPE:
+		return i->ldir->parent_inode;
+	default:
+		printe("Error: this is not a directory.\n");
+		return 0;
 	}
 }
 
+/* Compare a (not null-terminated) entry name with 'name', like strcmp() */
+static int sqfs_name_cmp(const char *entry_name, size_t entry_length,
+			 const char *name, size_t length)
+{
+	int ret;
+
+	ret = memcmp(entry_name, name,
+		     entry_length < length ? entry_length : length);
+	if (ret)
+		return ret;
+
+	return (entry_length > length) - (entry_length < length);
+}
+
+/*
+ * Look for 'name' among the entries of directory 'dir' and return the header
+ * and entry describing it.
+ *
+ * Entries are sorted by name. For extended directories, the directory index
+ * gives the first name of the header runs starting in each metadata block, so
+ * the search starts at the last run whose first name is not greater than
+ * 'name', without decompressing the blocks before it. Inside a run (up to 256
+ * entries sharing a header), entries are binary searched.
+ */
+int sqfs_dir_lookup(struct sqfs_ctx *ctx, union squashfs_inode *dir,
+		    const char *name, struct directory_header **header,
+		    struct directory_entry **entry)
+{
+	struct directory_entry *run[SQUASHFS_DIR_COUNT], *e;
+	struct sqfs_meta_table *dir_table = &ctx->dir_table;
+	struct squashfs_dir_index *index = NULL;
+	int k, i_count = 0, low, high, mid, cmp;
+	uint32_t start_block, size;
+	struct directory_header *h;
+	size_t length = strlen(name);
+	uint64_t pos, end;
+	int64_t start;
+	uint16_t offset;
+
+	if (sqfs_get_dir_location(dir, &start_block, &offset, &size))
+		return -ENOTDIR;
+
+	if (!size)
+		return -ENOENT;
+
+	if (dir->base->inode_type == SQUASHFS_LDIR_TYPE) {
+		i_count = dir->ldir->i_count;
+		index = dir->ldir->index;
+	}
+
+	start = sqfs_meta_table_pos(dir_table, start_block, offset);
+	if (start < 0)
+		return -EINVAL;
+
+	pos = start;
+	end = start + size;
+
+	for (k = 0; k < i_count; k++) {
+		if (sqfs_name_cmp((char *)index->name, index->size + 1, name,
+				  length) > 0)
+			break;
+
+		/* 'index' is the offset of the header into the listing */
+		start = sqfs_meta_table_pos(dir_table, index->start_block,
+					    (index->index + offset) %
+					    METADATA_BLOCK_SIZE);
+		if (start < 0 || start >= end)
+			return -EINVAL;
+
+		pos = start;
+		index = (void *)index + DIR_INDEX_BASE_LENGTH + index->size + 1;
+	}
+
+	printd("Directory lookup of %s starts at %ld\n", name, pos);
+
+	while (pos < end) {
+		h = sqfs_meta_table_at(dir_table, pos, sizeof(*h));
+		if (!h || h->count >= SQUASHFS_DIR_COUNT)
+			return -EINVAL;
+
+		pos += sizeof(*h);
+		for (k = 0; k <= h->count; k++) {
+			e = sqfs_meta_table_at(dir_table, pos,
+					       ENTRY_BASE_LENGTH);
+			if (!e)
+				return -EINVAL;
+
+			e = sqfs_meta_table_at(dir_table, pos, ENTRY_BASE_LENGTH
+					       + e->name_size + 1);
+			if (!e)
+				return -EINVAL;
+
+			run[k] = e;
+			pos += ENTRY_BASE_LENGTH + e->name_size + 1;
+		}
+
+		if (pos > end)
+			return -EINVAL;
+
+		/* Runs are sorted too: stop once past 'name' */
+		if (sqfs_name_cmp(run[0]->name, run[0]->name_size + 1, name,
+				  length) > 0)
+			break;
+
+		e = run[h->count];
+		if (sqfs_name_cmp(e->name, e->name_size + 1, name, length) < 0)
+			continue;
+
+		low = 0;
+		high = h->count;
+		while (low <= high) {
+			mid = low + (high - low) / 2;
+			e = run[mid];
+			cmp = sqfs_name_cmp(e->name, e->name_size + 1, name,
+					    length);
+			if (!cmp) {
+				*header = h;
+				*entry = e;
+				return 0;
+			} else if (cmp < 0) {
+				low = mid + 1;
+			} else {
+				high = mid - 1;
+			}
+		}
+
+		break;
+	}
+
+	return -ENOENT;
+}
+
 bool sqfs_is_empty_dir(union squashfs_inode *i)
 {
 	switch (i->base->inode_type) {
@@ -57,102 +300,64 @@ bool sqfs_is_empty_dir(union squashfs_inode *i)
 	case SQUASHFS_LDIR_TYPE:
 		return i->ldir->file_size == EMPTY_FILE_SIZE;
 	default:
-		printf("Error: this is not a directory.\n");
+		printe("Error: this is not a directory.\n");
 		return false;
 	}
 }
 
 void sqfs_print_dir_name(union squashfs_inode *dir,
 			 union squashfs_inode *parent,
-			 void *inode_table, void *dir_table)
+			 struct sqfs_meta_table *dir_table)
 {
-	int k, l, total_length = 0, inode_number, name_length;
-	struct directory_header *parent_header;
-	struct directory_entry *entry;
+	struct sqfs_dirent dirent;
+	struct sqfs_dir_iter iter;
 
 	/*
 	 * Retrieve the parent inode in the directory table,
 	 * since only the parent holds this directory's name within its entries.
 	 */
-	parent_header = dir_table +
-		(parent->dir->start_block * METADATA_BLOCK_SIZE) +
-		parent->dir->offset;
-
-	for (k = 0; k <= parent_header->count; k++) {
-		entry = (void *)parent_header + sizeof(*parent_header) +
-			total_length;
-
-		name_length = entry->name_size + 1;
-		inode_number = parent_header->inode_number +
-			entry->inode_offset;
-
-		if (inode_number == dir->dir->inode_number) {
-			printf("Name: ");
-			for (l = 0; l < name_length; l++)
-				printf("%c", entry->name[l]);
-			printf("\n");
+	if (sqfs_dir_iter_init(&iter, dir_table, parent))
+		return;
+
+	while (sqfs_dir_iter_next(&iter, &dirent) > 0) {
+		if (dirent.inode_number == dir->base->inode_number) {
+			printf("Name: %.*s\n", (int)dirent.name_length,
+			       dirent.name);
+			return;
 		}
-
-		total_length += ENTRY_BASE_LENGTH + name_length;
 	}
 }
 
 int sqfs_dump_dir(union squashfs_inode *dir, union squashfs_inode *parent,
-		  void *inode_table, void *dir_table)
+		  struct sqfs_meta_table *dir_table)
 {
-	int l, k, total_length = 0, name_length;
-	struct directory_header *dir_header;
-	struct directory_entry *entry;
+	struct sqfs_dirent dirent;
+	struct sqfs_dir_iter iter;
+	int k, ret;
 
-	if (dir->base->inode_type == SQUASHFS_DIR_TYPE) {
-		dir_header = dir_table +
-			(dir->dir->start_block * METADATA_BLOCK_SIZE) +
-			dir->dir->offset;
-	} else if (dir->base->inode_type == SQUASHFS_LDIR_TYPE) {
-		dir_header = dir_table +
-			(dir->ldir->start_block * METADATA_BLOCK_SIZE) +
-			dir->ldir->offset;
-	} else {
-		return -EINVAL;
-	}
+	ret = sqfs_dir_iter_init(&iter, dir_table, dir);
+	if (ret)
+		return ret;
 
-	sqfs_print_dir_name(dir, parent, inode_table, dir_table);
+	sqfs_print_dir_name(dir, parent, dir_table);
 	printd("--- --- --- ---\n");
 
 	/*
 	 * For each directory inode, the directory table stores a list of all
 	 * entries stored inside, with references back to the inodes that
-	 * describe those entries. 'count' is the number of entries, which
-	 * matches with the number of contents - 1.
-	 */
-	printd("Number of contents: %u\n", dir_header->count + 1);
-
-	/* The block's index in the Inode Table where the inode is stored. */
-	printd("Inode table offset: 0x%08x\n", dir_header->start);
-
-	/*
-	 * An arbitrary inode number. The entries that follow store their inode
-	 * number as a difference to this.
+	 * describe those entries. Entries are grouped behind headers, one per
+	 * run of at most 256 entries whose inodes share a metadata block.
 	 */
-	printd("Inode number: 0x%08x\n", dir_header->inode_number);
-
 	printd("Directory entries:\n");
-	total_length = 0;
-	for (k = 0; k <= dir_header->count ; k++) {
-		entry = (void *)dir_header + sizeof(*dir_header) + total_length;
-
+	for (k = 1; (ret = sqfs_dir_iter_next(&iter, &dirent)) > 0; k++) {
 		/* Entry name */
-		printf("%d) ", k + 1);
-		name_length = entry->name_size + 1;
-		for (l = 0; l < name_length; l++)
-			printf("%c", entry->name[l]);
-		printf(":\n");
+		printf("%d) %.*s:\n", k, (int)dirent.name_length, dirent.name);
 
 		/*
 		 * Inode type: for extended inodes, the corresponding basic type
 		 * is stored here instead.
 		 */
-		switch (entry->type) {
+		switch (dirent.type) {
 		case SQUASHFS_DIR_TYPE:
 		case SQUASHFS_LDIR_TYPE:
 			printd("Directory\n");
@@ -182,246 +387,93 @@ int sqfs_dump_dir(union squashfs_inode *dir, union squashfs_inode *parent,
 			return -EINVAL;
 		}
 
-		/* Offset into the uncompressed inode metadata block */
-		printd("Entry offset: 0x%04x\n", entry->offset);
-
 		/*
-		 * The difference of this inode's number to the reference
-		 * stored in the header
+		 * Inode metadata block and offset into the uncompressed block,
+		 * followed by the inode number (header's base + entry offset)
 		 */
-		printd("Inode offset: 0x%04x\n", entry->inode_offset);
+		printd("Inode reference: 0x%lx\n", dirent.inode_ref);
+		printd("Inode number: %u\n", dirent.inode_number);
 
 		printf("\n");
-		total_length += ENTRY_BASE_LENGTH + name_length;
 	}
 
 	printd("--- --- --- ---\n\n");
 
-	return 0;
+	return ret;
 }
 
-int sqfs_dump_directory_table(void *file_mapping)
+int sqfs_dump_directory_table(struct sqfs_image *img)
 {
-	int ret = 0, k, l, block_list_size, inode_sizes = 0, dir_count = 0;
-	int index_list_size = 0;
-	unsigned char *dest_inode_table = NULL, *dest_dir_table = NULL;
-	void *dir_table, *inode_table;
+	int ret = 0, k, dir_count = 0;
 	struct squashfs_super_block *sblk;
 	union squashfs_inode i, parent;
-	unsigned long dest_len;
-	size_t data_size;
-	bool compressed;
+	uint64_t inode_sizes = 0;
+	struct sqfs_ctx ctx;
+	size_t size;
 
-	sblk = file_mapping;
+	sblk = (void *)img->head;
 
-	/* Parse inode table (metadata block) header */
-	ret = sqfs_read_metablock(file_mapping, sblk->inode_table_start,
-				  &compressed, &data_size);
-	if (ret) {
-		printf("Null pointers passed to sqfs_read_metablock.\n");
+	/* Index the inode and directory tables' metadata blocks */
+	ret = sqfs_ctx_init(&ctx, img);
+	if (ret)
 		return ret;
-	}
-
-	inode_table = file_mapping + sblk->inode_table_start + HEADER_SIZE;
-
-	/* Extract compressed Inode table */
-	if (compressed) {
-		dest_len = METADATA_BLOCK_SIZE;
-		dest_inode_table = malloc(dest_len);
-		if (!dest_inode_table) {
-			printf("%s: Memory allocation error.\n", __func__);
-			free(dest_inode_table);
-			return errno;
-		}
-
-		ret = sqfs_decompress(dest_inode_table, &dest_len, inode_table,
-				      data_size);
-		if (ret != Z_OK) {
-			printf("Error while uncompressing metadata.\n");
-			return ret;
-		}
-
-		printd("Uncompressed table size: %lu bytes\n", dest_len);
-		inode_table = dest_inode_table;
-	}
-
-	/* Parse directory table (metadata block) header */
-	ret = sqfs_read_metablock(file_mapping, sblk->directory_table_start,
-				  &compressed, &data_size);
-	if (ret) {
-		printf("Null pointers passed to sqfs_read_metablock.\n");
-		if (compressed)
-			free(dest_inode_table);
-	}
-
-	dir_table = file_mapping + sblk->directory_table_start + HEADER_SIZE;
-
-	/* Extract compressed Directory table */
-	if (compressed) {
-		dest_len = METADATA_BLOCK_SIZE;
-		dest_dir_table = malloc(dest_len);
-		if (!dest_dir_table) {
-			printf("%s: Memory allocation error.\n", __func__);
-			free(dest_dir_table);
-			return errno;
-		}
-
-		ret = sqfs_decompress(dest_dir_table, &dest_len, dir_table,
-				      data_size);
-		if (ret != Z_OK) {
-			printf("Error while uncompressing metadata.\n");
-			return ret;
-		}
-
-		printd("Uncompressed table size: %lu bytes\n", dest_len);
-		dir_table = dest_dir_table;
-	}
 
 	printd("\nDIRECTORY TABLE:\n\n");
 
-	/*
-	 * First 'parent' inode must be the root inode itself, and its inode
-	 * number is equal to the number of inodes
-	 */
-	parent.base = sqfs_find_inode(inode_table, sblk->inodes, sblk->inodes,
-				      sblk->block_size);
-
 	/*
 	 * Find directory/extended directory inodes in Inode table and then
 	 * retrieve their positions in the uncompressed Directory table.
 	 */
 	for (k = 0; k < sblk->inodes; k++) {
-		i.base = inode_table + inode_sizes;
-		switch (i.base->inode_type) {
-		case SQUASHFS_DIR_TYPE:
-			i.dir = inode_table + inode_sizes;
-
-			/* Look for a parent when the inode is not the root */
-			if (k != sblk->inodes - 1) {
-				printf("Directory %d\n", ++dir_count);
-				parent.base = sqfs_find_inode(inode_table,
-							      i.dir->parent_inode,
-							      sblk->inodes,
-							      sblk->block_size);
-			} else {
-				printf("Root directory\n");
-			}
-
-			if (sqfs_is_empty_dir(&i)) {
-				sqfs_print_dir_name(&i, &parent, inode_table,
-						    dir_table);
-				printf("Empty directory.\n\n");
-			} else {
-				sqfs_dump_dir(&i, &parent, inode_table,
-					      dir_table);
-			}
-
-			inode_sizes += sizeof(struct squashfs_dir_inode);
+		i.base = sqfs_read_inode(&ctx.inode_table, inode_sizes,
+					 sblk->block_size, &size);
+		if (!i.base) {
+			printe("Error while reading inode.\n");
+			ret = -EINVAL;
 			break;
-		case SQUASHFS_LDIR_TYPE:
-			i.ldir = inode_table + inode_sizes;
+		}
+
+		inode_sizes += size;
+		if (i.base->inode_type != SQUASHFS_DIR_TYPE &&
+		    i.base->inode_type != SQUASHFS_LDIR_TYPE)
+			continue;
 
-			/* Look for a parent when the inode is not the root */
-			if (k != sblk->inodes - 1) {
+		/*
+		 * Look for a parent when the inode is not the root, whose
+		 * inode number is equal to the number of inodes
+		 */
+		if (i.base->inode_number != sblk->inodes) {
+			if (i.base->inode_type == SQUASHFS_DIR_TYPE)
+				printf("Directory %d\n", ++dir_count);
+			else
 				printf("(extended) Directory %d\n",
 				       ++dir_count);
-				parent.base = sqfs_find_inode(inode_table,
-							      i.ldir->parent_inode,
-							      sblk->inodes,
-							      sblk->block_size);
-			} else {
-				printf("Root (extended) directory\n");
-			}
 
-			if (sqfs_is_empty_dir(&i)) {
-				sqfs_print_dir_name(&i, &parent, inode_table,
-						    dir_table);
-				printf("Empty directory.\n\n");
-			} else {
-				sqfs_dump_dir(&i, &parent, inode_table,
-					      dir_table);
-			}
-
-			/*
-			 * Calculate inode size: if there are no indexes, no
-			 * need to calculate the index list size.
-			 */
-			if (i.ldir->i_count == 0) {
-				inode_sizes +=
-					sizeof(struct squashfs_ldir_inode);
+			parent.base = sqfs_find_inode(&ctx,
+						      sqfs_get_parent_inode(&i));
+			if (!parent.base) {
+				printe("Parent inode not found.\n");
+				ret = -EINVAL;
 				break;
 			}
+		} else {
+			if (i.base->inode_type == SQUASHFS_DIR_TYPE)
+				printf("Root directory\n");
+			else
+				printf("Root (extended) directory\n");
 
-			for (l = 0; l < i.ldir->i_count + 1; l++)
-				index_list_size += i.ldir->index[l].size + 1;
-
-			inode_sizes += sizeof(struct squashfs_ldir_inode) +
-				((i.ldir->i_count + 1) * DIR_INDEX_BASE_LENGTH)
-				+ index_list_size;
-
-			index_list_size = 0;
-			break;
-		case SQUASHFS_REG_TYPE:
-			i.reg = inode_table + inode_sizes;
-			if (i.reg->fragment == 0xFFFFFFFF) {
-				block_list_size = ceil((float)i.reg->file_size
-						       / sblk->block_size);
-			} else {
-				block_list_size = (i.reg->file_size /
-						   sblk->block_size);
-			}
-
-			inode_sizes += sizeof(struct squashfs_reg_inode) +
-				(block_list_size * sizeof(uint32_t));
-
-			break;
-		case SQUASHFS_LREG_TYPE:
-			i.lreg = inode_table + inode_sizes;
-			if (i.lreg->fragment == 0xFFFFFFFF) {
-				block_list_size = ceil((float)i.lreg->file_size
-						       / sblk->block_size);
-			} else {
-				block_list_size = (i.lreg->file_size /
-						   sblk->block_size);
-			}
-
-			inode_sizes += sizeof(struct squashfs_lreg_inode) +
-				(block_list_size * sizeof(uint32_t));
-
-			break;
-		case SQUASHFS_SYMLINK_TYPE:
-		case SQUASHFS_LSYMLINK_TYPE:
-			i.symlink = inode_table + inode_sizes;
-			inode_sizes += sizeof(struct squashfs_symlink_inode) +
-				i.symlink->symlink_size;
+			parent.base = i.base;
+		}
 
-			break;
-		case SQUASHFS_BLKDEV_TYPE:
-		case SQUASHFS_CHRDEV_TYPE:
-			inode_sizes += sizeof(struct squashfs_dev_inode);
-			break;
-		case SQUASHFS_LBLKDEV_TYPE:
-		case SQUASHFS_LCHRDEV_TYPE:
-			inode_sizes += sizeof(struct squashfs_ldev_inode);
-			break;
-		case SQUASHFS_FIFO_TYPE:
-		case SQUASHFS_SOCKET_TYPE:
-			inode_sizes += sizeof(struct squashfs_ipc_inode);
-			break;
-		case SQUASHFS_LFIFO_TYPE:
-		case SQUASHFS_LSOCKET_TYPE:
-			inode_sizes += sizeof(struct squashfs_lipc_inode);
-			break;
-		default:
-			printf("Unknown inode type\n");
-			ret = -EINVAL;
+		if (sqfs_is_empty_dir(&i)) {
+			sqfs_print_dir_name(&i, &parent, &ctx.dir_table);
+			printf("Empty directory.\n\n");
+		} else {
+			sqfs_dump_dir(&i, &parent, &ctx.dir_table);
 		}
 	}
 
-	if (!dest_inode_table)
-		free(dest_inode_table);
-	if (!dest_dir_table)
-		free(dest_dir_table);
+	sqfs_ctx_free(&ctx);
 
 	return ret;
 }
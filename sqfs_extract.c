@@ -0,0 +1,1012 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Bootlin
+ *
+ * Author: Joao Marcos Costa <joaomarcos.costa@bootlin.com>
+ *
+ * sqfs_extract.c: extract a whole directory tree to the filesystem
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sqfs_filesystem.h"
+#include "sqfs_pool.h"
+#include "sqfs_utils.h"
+#include "sqfs_decompressor.h"
+
+/* Number of data blocks written by a single task */
+#define SQFS_EXTRACT_CHUNK 16
+
+/* Tail end of a file, stored in a fragment block */
+struct sqfs_frag_owner {
+	uint32_t fragment;
+	uint32_t offset;
+	/* Position and size of the tail in the output file */
+	uint64_t pos, len;
+	mode_t mode;
+	char *path;
+};
+
+/* Directory created for us alone, given its mode once it is filled */
+struct sqfs_dir_mode {
+	mode_t mode;
+	char *path;
+};
+
+/*
+ * Extraction state shared by all tasks. The inode and directory tables are
+ * fully loaded beforehand, so they are only read by the workers. Fragment
+ * blocks go through the context's (locked) fragment cache.
+ *
+ * Tail ends are not written along with the rest of their file: the tree walk
+ * only records them in 'owners'. Once it is over, they are grouped by fragment
+ * block, so that each block is decompressed once and scattered to all its
+ * owners, whatever the directory they belong to.
+ *
+ * Files and directories are created with owner permissions only, whatever
+ * the umask, and get the exact mode of the image once written. A directory is
+ * recorded in 'dirs' before any of its subdirectories, so that their modes
+ * are applied deepest-first by walking the array backwards.
+ */
+struct sqfs_extract {
+	struct sqfs_ctx *ctx;
+	struct sqfs_pool pool;
+	/* Decompression context, block buffer and block reader of each worker */
+	struct sqfs_decomp *decomps;
+	unsigned char **buffers;
+	struct sqfs_block_reader *readers;
+	/* Fragment plan, filled by the file tasks */
+	pthread_mutex_t plan_lock;
+	struct sqfs_frag_owner *owners;
+	size_t owner_count, owner_capacity;
+	struct sqfs_dir_mode *dirs;
+	size_t dir_count, dir_capacity;
+	/* First error met by a task, the others stop early */
+	int error;
+};
+
+/* List a directory and create its entries */
+struct sqfs_dir_task {
+	struct sqfs_task task;
+	struct sqfs_extract *ex;
+	union squashfs_inode inode;
+	char *path;
+};
+
+/* Create a regular file, then split its content into chunks */
+struct sqfs_file_task {
+	struct sqfs_task task;
+	struct sqfs_extract *ex;
+	union squashfs_inode inode;
+	char *path;
+};
+
+/* Output file, released by the last chunk written */
+struct sqfs_out_file {
+	struct sqfs_extract *ex;
+	struct sqfs_file file;
+	char *path;
+	/* Applied on close, or after the tail end if the file has one */
+	mode_t mode;
+	int fd;
+	int refs;
+};
+
+/* 'count' data blocks from 'first' */
+struct sqfs_chunk_task {
+	struct sqfs_task task;
+	struct sqfs_out_file *out;
+	uint64_t first, count;
+	/* On-disk offset of block 'first' */
+	uint64_t offset;
+};
+
+/* Scatter one fragment block to the 'count' files sharing it */
+struct sqfs_frag_task {
+	struct sqfs_task task;
+	struct sqfs_extract *ex;
+	struct sqfs_frag_owner *owners;
+	size_t count;
+};
+
+static int sqfs_extract_entry(struct sqfs_extract *ex,
+			      union squashfs_inode *i, char *path);
+
+static void sqfs_extract_fail(struct sqfs_extract *ex, int error)
+{
+	int expected = 0;
+
+	__atomic_compare_exchange_n(&ex->error, &expected, error, false,
+				    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+static bool sqfs_extract_failed(struct sqfs_extract *ex)
+{
+	return __atomic_load_n(&ex->error, __ATOMIC_SEQ_CST);
+}
+
+static void sqfs_out_file_put(struct sqfs_out_file *out)
+{
+	if (__atomic_sub_fetch(&out->refs, 1, __ATOMIC_SEQ_CST))
+		return;
+
+	if (!IS_FRAGMENTED(out->file.fragment) &&
+	    fchmod(out->fd, out->mode)) {
+		sqfs_extract_fail(out->ex, -errno);
+		printe("%s: Cannot set the mode of %s.\n", __func__, out->path);
+	}
+
+	if (close(out->fd)) {
+		printe("%s: Error while closing %s.\n", __func__, out->path);
+		sqfs_extract_fail(out->ex, -errno);
+	}
+
+	free(out->path);
+	free(out);
+}
+
+/*
+ * Copy 'len' bytes stored uncompressed at 'offset' in the image to 'pos' in
+ * 'fd', within the kernel if possible.
+ */
+static int sqfs_extract_raw(struct sqfs_extract *ex, uint64_t offset, int fd,
+			    uint64_t pos, size_t len)
+{
+	struct sqfs_image *img = ex->ctx->image;
+	size_t size;
+	const void *data;
+	int ret;
+
+	if (img->fd >= 0) {
+		ret = sqfs_copy_range(img->fd, offset, fd, pos, len);
+		if (ret != -EOPNOTSUPP)
+			return ret;
+	}
+
+	/* Views of non-mapped images are read into memory: keep them small */
+	for (; len; len -= size) {
+		size = len < ex->ctx->sblk->block_size ? len :
+		       ex->ctx->sblk->block_size;
+		data = sqfs_image_view(img, offset, size);
+		if (!data)
+			return -EIO;
+
+		ret = sqfs_pwrite(fd, data, size, pos);
+		if (ret)
+			return ret;
+
+		offset += size;
+		pos += size;
+	}
+
+	return 0;
+}
+
+static int sqfs_extract_blocks(struct sqfs_extract *ex, int worker,
+			       struct sqfs_chunk_task *chunk)
+{
+	struct sqfs_block_reader *reader = &ex->readers[worker];
+	struct sqfs_file *file = &chunk->out->file;
+	struct sqfs_ctx *ctx = ex->ctx;
+	uint32_t block_size = ctx->sblk->block_size;
+	uint64_t j, end, pos, offset;
+	unsigned char *block, *data;
+	const void *src;
+	uint32_t entry;
+	size_t size, len;
+	int ret;
+
+	/* Only the compressed blocks go through the reader */
+	ret = sqfs_block_reader_start(reader, file, chunk->first, chunk->count,
+				      chunk->offset);
+	if (ret)
+		return ret;
+
+	block = ex->buffers[worker];
+	offset = chunk->offset;
+	end = chunk->first + chunk->count;
+	for (j = chunk->first; j < end; j++) {
+		if (sqfs_extract_failed(ex))
+			return 0;
+
+		entry = file->block_list[j];
+		pos = j * block_size;
+
+		/* ftruncate() left a hole there already */
+		if (IS_SPARSE_BLOCK(entry))
+			continue;
+
+		/*
+		 * Raw blocks which follow each other are contiguous in the
+		 * image as in the file: copy them at once.
+		 */
+		if (!COMPRESSED_DATABLOCK(entry)) {
+			size = DATABLOCK_SIZE(entry);
+			while (j + 1 < end && file->block_list[j + 1] &&
+			       !COMPRESSED_DATABLOCK(file->block_list[j + 1]))
+				size += DATABLOCK_SIZE(file->block_list[++j]);
+
+			len = size;
+			if (len > file->file_size - pos)
+				len = file->file_size - pos;
+
+			ret = sqfs_extract_raw(ex, offset, chunk->out->fd, pos,
+					       len);
+			if (ret)
+				return ret;
+
+			offset += size;
+			continue;
+		}
+
+		ret = sqfs_block_reader_next(reader, &src, &size);
+		if (ret)
+			return ret;
+
+		ret = sqfs_decode_datablock(ctx, &ex->decomps[worker], entry,
+					    src, block, &data, &len);
+		if (ret)
+			return ret;
+
+		offset += DATABLOCK_SIZE(entry);
+
+		if (len > file->file_size - pos)
+			len = file->file_size - pos;
+
+		ret = sqfs_pwrite(chunk->out->fd, data, len, pos);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static void sqfs_chunk_run(struct sqfs_task *task, int worker)
+{
+	struct sqfs_chunk_task *chunk = (struct sqfs_chunk_task *)task;
+	struct sqfs_out_file *out = chunk->out;
+	struct sqfs_extract *ex = out->ex;
+	int ret = 0;
+
+	if (!sqfs_extract_failed(ex))
+		ret = sqfs_extract_blocks(ex, worker, chunk);
+
+	if (ret) {
+		printe("Error while extracting %s.\n", out->path);
+		sqfs_extract_fail(ex, ret);
+	}
+
+	sqfs_out_file_put(out);
+	free(chunk);
+}
+
+/* Record the tail end of 'out', written once the whole tree is created */
+static int sqfs_extract_plan_add(struct sqfs_extract *ex,
+				 struct sqfs_out_file *out, mode_t mode)
+{
+	struct sqfs_file *file = &out->file;
+	struct sqfs_frag_owner *owner;
+	size_t capacity;
+	char *path;
+
+	path = strdup(out->path);
+	if (!path)
+		return -ENOMEM;
+
+	pthread_mutex_lock(&ex->plan_lock);
+	if (ex->owner_count == ex->owner_capacity) {
+		capacity = ex->owner_capacity ? 2 * ex->owner_capacity : 64;
+		owner = realloc(ex->owners, capacity * sizeof(*owner));
+		if (!owner) {
+			pthread_mutex_unlock(&ex->plan_lock);
+			free(path);
+			return -ENOMEM;
+		}
+
+		ex->owners = owner;
+		ex->owner_capacity = capacity;
+	}
+
+	owner = &ex->owners[ex->owner_count++];
+	owner->fragment = file->fragment;
+	owner->offset = file->frag_offset;
+	owner->pos = file->block_count * ex->ctx->sblk->block_size;
+	owner->len = file->file_size - owner->pos;
+	owner->mode = mode;
+	owner->path = path;
+	pthread_mutex_unlock(&ex->plan_lock);
+
+	return 0;
+}
+
+/* Record the mode of the directory at 'path', restored once it is filled */
+static int sqfs_extract_dir_add(struct sqfs_extract *ex, const char *path,
+				mode_t mode)
+{
+	struct sqfs_dir_mode *dir;
+	size_t capacity;
+	char *copy;
+
+	copy = strdup(path);
+	if (!copy)
+		return -ENOMEM;
+
+	pthread_mutex_lock(&ex->plan_lock);
+	if (ex->dir_count == ex->dir_capacity) {
+		capacity = ex->dir_capacity ? 2 * ex->dir_capacity : 16;
+		dir = realloc(ex->dirs, capacity * sizeof(*dir));
+		if (!dir) {
+			pthread_mutex_unlock(&ex->plan_lock);
+			free(copy);
+			return -ENOMEM;
+		}
+
+		ex->dirs = dir;
+		ex->dir_capacity = capacity;
+	}
+
+	dir = &ex->dirs[ex->dir_count++];
+	dir->mode = mode;
+	dir->path = copy;
+	pthread_mutex_unlock(&ex->plan_lock);
+
+	return 0;
+}
+
+/* Called once every task is over, children before their parents */
+static int sqfs_extract_dir_modes(struct sqfs_extract *ex)
+{
+	struct sqfs_dir_mode *dir;
+	size_t k;
+	int ret;
+
+	for (k = ex->dir_count; k--; ) {
+		dir = &ex->dirs[k];
+		if (chmod(dir->path, dir->mode)) {
+			ret = -errno;
+			printe("Cannot set the mode of %s.\n", dir->path);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Remove what an earlier extraction may have left at 'path', so that the
+ * entry is created anew rather than written through: the former one may be a
+ * symbolic link, or a file we can no longer write to.
+ */
+static int sqfs_extract_unlink(const char *path)
+{
+	if (unlink(path) && errno != ENOENT)
+		return -errno;
+
+	return 0;
+}
+
+/* Create a directory to fill, or reuse the one an earlier extraction left */
+static int sqfs_extract_mkdir(const char *path)
+{
+	struct stat st;
+
+	if (!mkdir(path, S_IRWXU))
+		return 0;
+
+	if (errno != EEXIST || lstat(path, &st))
+		return -errno;
+
+	if (!S_ISDIR(st.st_mode)) {
+		if (unlink(path) || mkdir(path, S_IRWXU))
+			return -errno;
+	} else if ((st.st_mode & S_IRWXU) != S_IRWXU &&
+		   chmod(path, S_IRWXU)) {
+		return -errno;
+	}
+
+	return 0;
+}
+
+static int sqfs_extract_tail(struct sqfs_extract *ex,
+			     struct sqfs_frag_owner *owner,
+			     struct sqfs_frag_cache_entry *frag)
+{
+	int fd, ret = 0;
+
+	if (owner->offset > frag->size ||
+	    owner->len > frag->size - owner->offset) {
+		printe("%s: Invalid fragment offset.\n", __func__);
+		return -EINVAL;
+	}
+
+	fd = open(owner->path, O_WRONLY);
+	if (fd < 0)
+		return -errno;
+
+	/* Fragment blocks stored uncompressed are not copied to memory */
+	if (frag->data != frag->buffer)
+		ret = sqfs_extract_raw(ex, frag->data + owner->offset -
+				       ex->ctx->image->base,
+				       fd, owner->pos, owner->len);
+	else
+		ret = sqfs_pwrite(fd, frag->data + owner->offset, owner->len,
+				  owner->pos);
+
+	if (!ret && fchmod(fd, owner->mode))
+		ret = -errno;
+
+	if (close(fd) && !ret)
+		ret = -errno;
+
+	return ret;
+}
+
+static void sqfs_frag_task_run(struct sqfs_task *task, int worker)
+{
+	struct sqfs_frag_task *ft = (struct sqfs_frag_task *)task;
+	struct sqfs_extract *ex = ft->ex;
+	struct sqfs_frag_cache_entry *frag;
+	size_t k;
+	int ret;
+
+	if (sqfs_extract_failed(ex))
+		goto free_task;
+
+	ret = sqfs_frag_cache_get(&ex->ctx->frag_cache, &ex->decomps[worker],
+				  ft->owners[0].fragment, &frag);
+	if (ret) {
+		sqfs_extract_fail(ex, ret);
+		goto free_task;
+	}
+
+	for (k = 0; k < ft->count && !sqfs_extract_failed(ex); k++) {
+		ret = sqfs_extract_tail(ex, &ft->owners[k], frag);
+		if (ret) {
+			printe("Error while extracting %s.\n",
+			       ft->owners[k].path);
+			sqfs_extract_fail(ex, ret);
+		}
+	}
+
+	sqfs_frag_cache_put(&ex->ctx->frag_cache, frag);
+
+free_task:
+	free(ft);
+}
+
+static int sqfs_frag_owner_cmp(const void *a, const void *b)
+{
+	const struct sqfs_frag_owner *x = a, *y = b;
+
+	if (x->fragment != y->fragment)
+		return x->fragment < y->fragment ? -1 : 1;
+
+	/* Read each fragment block sequentially */
+	if (x->offset != y->offset)
+		return x->offset < y->offset ? -1 : 1;
+
+	return 0;
+}
+
+/* Group the recorded tail ends by fragment block, one task per block */
+static int sqfs_extract_plan_run(struct sqfs_extract *ex)
+{
+	struct sqfs_frag_task *ft;
+	size_t k, n, blocks = 0;
+	int ret;
+
+	qsort(ex->owners, ex->owner_count, sizeof(*ex->owners),
+	      sqfs_frag_owner_cmp);
+
+	for (k = 0; k < ex->owner_count; k += n) {
+		for (n = 1; k + n < ex->owner_count; n++) {
+			if (ex->owners[k + n].fragment != ex->owners[k].fragment)
+				break;
+		}
+
+		ft = malloc(sizeof(*ft));
+		if (!ft)
+			return -ENOMEM;
+
+		ft->task.run = sqfs_frag_task_run;
+		ft->ex = ex;
+		ft->owners = &ex->owners[k];
+		ft->count = n;
+		ret = sqfs_pool_submit(&ex->pool, &ft->task);
+		if (ret) {
+			free(ft);
+			return ret;
+		}
+
+		blocks++;
+	}
+
+	printd("%zu tail ends in %zu fragment blocks\n", ex->owner_count,
+	       blocks);
+
+	return 0;
+}
+
+/*
+ * Create the file and queue one task per SQFS_EXTRACT_CHUNK data blocks. The
+ * first chunk is written right away, the fragment is left to the plan.
+ */
+static int sqfs_file_task_start(struct sqfs_file_task *ft, int worker)
+{
+	struct sqfs_extract *ex = ft->ex;
+	struct sqfs_chunk_task *chunk, *first = NULL;
+	struct sqfs_out_file *out;
+	uint64_t j, offset;
+	int k, parts, ret;
+
+	out = calloc(1, sizeof(*out));
+	if (!out)
+		return -ENOMEM;
+
+	out->ex = ex;
+	out->path = ft->path;
+	out->mode = ft->inode.base->mode & 07777;
+	ft->path = NULL;
+
+	ret = sqfs_file_init(ex->ctx, &ft->inode, &out->file);
+	if (ret)
+		goto free_out;
+
+	/* Reopened for the tail end, once the tree is created */
+	if (IS_FRAGMENTED(out->file.fragment)) {
+		ret = sqfs_extract_plan_add(ex, out, out->mode);
+		if (ret)
+			goto free_out;
+	}
+
+	ret = sqfs_extract_unlink(out->path);
+	if (!ret) {
+		out->fd = open(out->path, O_WRONLY | O_CREAT | O_EXCL,
+			       S_IRUSR | S_IWUSR);
+		if (out->fd < 0)
+			ret = -errno;
+	}
+
+	if (ret) {
+		printe("Cannot create %s.\n", out->path);
+		goto free_out;
+	}
+
+	/* Holes are left for the chunks written later, in any order */
+	if (ftruncate(out->fd, out->file.file_size)) {
+		ret = -errno;
+		close(out->fd);
+		goto free_out;
+	}
+
+	parts = DIV_ROUND_UP(out->file.block_count, SQFS_EXTRACT_CHUNK);
+	if (!parts) {
+		out->refs = 1;
+		sqfs_out_file_put(out);
+		return 0;
+	}
+
+	/* Keep a reference until every part has been handed over */
+	out->refs = parts + 1;
+	offset = out->file.start_block;
+	for (j = 0; j < out->file.block_count; j++)
+		offset += DATABLOCK_SIZE(out->file.block_list[j]);
+
+	/*
+	 * Submitted from the end: this worker pops the most recent task first,
+	 * and so goes through the file, and the image, in order, as the
+	 * kernel readahead expects. The others steal the last parts.
+	 */
+	for (k = parts - 1; k >= 0; k--) {
+		chunk = calloc(1, sizeof(*chunk));
+		if (!chunk) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		chunk->task.run = sqfs_chunk_run;
+		chunk->out = out;
+		chunk->first = (uint64_t)k * SQFS_EXTRACT_CHUNK;
+		chunk->count = out->file.block_count - chunk->first;
+		if (chunk->count > SQFS_EXTRACT_CHUNK)
+			chunk->count = SQFS_EXTRACT_CHUNK;
+
+		for (j = chunk->first + chunk->count; j > chunk->first; j--)
+			offset -= DATABLOCK_SIZE(out->file.block_list[j - 1]);
+		chunk->offset = offset;
+
+		if (!k) {
+			first = chunk;
+			break;
+		}
+
+		ret = sqfs_pool_submit(&ex->pool, &chunk->task);
+		if (ret) {
+			free(chunk);
+			break;
+		}
+	}
+
+	/* Drop the references of the parts which were not created */
+	for (; ret && k >= 0; k--)
+		sqfs_out_file_put(out);
+
+	if (first)
+		sqfs_chunk_run(&first->task, worker);
+
+	sqfs_out_file_put(out);
+
+	return ret;
+
+free_out:
+	free(out->path);
+	free(out);
+
+	return ret;
+}
+
+static void sqfs_file_task_run(struct sqfs_task *task, int worker)
+{
+	struct sqfs_file_task *ft = (struct sqfs_file_task *)task;
+	int ret;
+
+	if (!sqfs_extract_failed(ft->ex)) {
+		ret = sqfs_file_task_start(ft, worker);
+		if (ret)
+			sqfs_extract_fail(ft->ex, ret);
+	}
+
+	free(ft->path);
+	free(ft);
+}
+
+static void sqfs_dir_task_run(struct sqfs_task *task, int worker)
+{
+	struct sqfs_dir_task *dt = (struct sqfs_dir_task *)task;
+	struct sqfs_extract *ex = dt->ex;
+	struct sqfs_dirent dirent;
+	struct sqfs_dir_iter iter;
+	union squashfs_inode i;
+	size_t len;
+	char *path;
+	int ret;
+
+	ret = sqfs_dir_iter_init(&iter, &ex->ctx->dir_table, &dt->inode);
+	while (!ret && !sqfs_extract_failed(ex)) {
+		ret = sqfs_dir_iter_next(&iter, &dirent);
+		if (ret <= 0)
+			break;
+
+		ret = 0;
+		/* Never let an entry escape the destination directory */
+		if (memchr(dirent.name, '/', dirent.name_length) ||
+		    (dirent.name_length == 1 && dirent.name[0] == '.') ||
+		    (dirent.name_length == 2 && !memcmp(dirent.name, "..", 2))) {
+			printe("Invalid entry name in %s.\n", dt->path);
+			ret = -EINVAL;
+			break;
+		}
+
+		i.base = sqfs_read_inode_ref(ex->ctx, dirent.inode_ref);
+		if (!i.base) {
+			ret = -EINVAL;
+			break;
+		}
+
+		len = strlen(dt->path);
+		path = malloc(len + dirent.name_length + 2);
+		if (!path) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		sprintf(path, "%s/%.*s", dt->path, (int)dirent.name_length,
+			dirent.name);
+		ret = sqfs_extract_entry(ex, &i, path);
+	}
+
+	if (ret < 0) {
+		printe("Error while extracting %s.\n", dt->path);
+		sqfs_extract_fail(ex, ret);
+	}
+
+	free(dt->path);
+	free(dt);
+}
+
+/*
+ * Create the entry found at 'path'. Directories and regular files are handed
+ * over to new tasks along with 'path', other entries are created right away.
+ * Entries already present are replaced, except directories, which are reused.
+ */
+static int sqfs_extract_entry(struct sqfs_extract *ex,
+			      union squashfs_inode *i, char *path)
+{
+	mode_t mode = i->base->mode & 07777, format;
+	uint16_t type = i->base->inode_type;
+	struct sqfs_file_task *ft;
+	struct sqfs_dir_task *dt;
+	char *target;
+	int ret = 0;
+
+	switch (type) {
+	case SQUASHFS_DIR_TYPE:
+	case SQUASHFS_LDIR_TYPE:
+		/* Children still have to be created in it */
+		ret = sqfs_extract_mkdir(path);
+		if (ret)
+			break;
+
+		ret = sqfs_extract_dir_add(ex, path, mode);
+		if (ret)
+			break;
+
+		dt = malloc(sizeof(*dt));
+		if (!dt) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		dt->task.run = sqfs_dir_task_run;
+		dt->ex = ex;
+		dt->inode = *i;
+		dt->path = path;
+		ret = sqfs_pool_submit(&ex->pool, &dt->task);
+		if (ret)
+			free(dt);
+		else
+			return 0;
+
+		break;
+	case SQUASHFS_REG_TYPE:
+	case SQUASHFS_LREG_TYPE:
+		ft = malloc(sizeof(*ft));
+		if (!ft) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		ft->task.run = sqfs_file_task_run;
+		ft->ex = ex;
+		ft->inode = *i;
+		ft->path = path;
+		ret = sqfs_pool_submit(&ex->pool, &ft->task);
+		if (ret)
+			free(ft);
+		else
+			return 0;
+
+		break;
+	case SQUASHFS_SYMLINK_TYPE:
+	case SQUASHFS_LSYMLINK_TYPE:
+		target = strndup(i->symlink->symlink, i->symlink->symlink_size);
+		if (!target) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		ret = sqfs_extract_unlink(path);
+		if (!ret && symlink(target, path))
+			ret = -errno;
+		free(target);
+		break;
+	case SQUASHFS_BLKDEV_TYPE:
+	case SQUASHFS_LBLKDEV_TYPE:
+	case SQUASHFS_CHRDEV_TYPE:
+	case SQUASHFS_LCHRDEV_TYPE:
+		ret = sqfs_extract_unlink(path);
+		if (ret)
+			break;
+
+		/* Creating devices needs privileges: warn, but go on */
+		format = (type == SQUASHFS_BLKDEV_TYPE ||
+			  type == SQUASHFS_LBLKDEV_TYPE) ? S_IFBLK : S_IFCHR;
+		if (mknod(path, format | mode, sqfs_rdev(i->dev->rdev)))
+			printe("Cannot create device %s.\n", path);
+		else if (chmod(path, mode))
+			ret = -errno;
+		break;
+	case SQUASHFS_FIFO_TYPE:
+	case SQUASHFS_LFIFO_TYPE:
+		ret = sqfs_extract_unlink(path);
+		if (ret)
+			break;
+
+		/* Unlike mkfifo() and mknod(), chmod() ignores the umask */
+		if (mkfifo(path, mode) || chmod(path, mode))
+			ret = -errno;
+		break;
+	case SQUASHFS_SOCKET_TYPE:
+	case SQUASHFS_LSOCKET_TYPE:
+		ret = sqfs_extract_unlink(path);
+		if (ret)
+			break;
+
+		if (mknod(path, mode | S_IFSOCK, 0) || chmod(path, mode))
+			ret = -errno;
+		break;
+	default:
+		printe("Unknown entry type\n");
+		ret = -EINVAL;
+	}
+
+	if (ret)
+		printe("Cannot create %s.\n", path);
+
+	free(path);
+
+	return ret;
+}
+
+/*
+ * Extract the file or directory tree at 'path' into the directory 'dest',
+ * using a pool of 'threads' workers. A directory's content is extracted
+ * directly into 'dest', other entries keep their name.
+ */
+int sqfs_extract(struct sqfs_image *img, const char *path, const char *dest,
+		 int threads)
+{
+	char *name, *out, *tokens;
+	struct sqfs_extract ex;
+	union squashfs_inode i;
+	struct sqfs_ctx ctx;
+	int k, ret;
+
+	memset(&ex, 0, sizeof(ex));
+	ex.ctx = &ctx;
+
+	ret = sqfs_ctx_init(&ctx, img);
+	if (ret)
+		return ret;
+
+	/* Make the tables read-only from now on */
+	ret = sqfs_meta_table_load_all(&ctx.inode_table);
+	if (!ret)
+		ret = sqfs_meta_table_load_all(&ctx.dir_table);
+	if (ret) {
+		printe("Error while reading the metadata tables.\n");
+		goto free_ctx;
+	}
+
+	/* sqfs_resolve_path() splits its argument */
+	tokens = sqfs_arena_strdup(&ctx.arena, path);
+	if (!tokens) {
+		ret = -ENOMEM;
+		goto free_ctx;
+	}
+
+	ret = sqfs_resolve_path(&ctx, tokens, &i);
+	if (ret)
+		goto free_ctx;
+
+	/* Name of the last path component, for non-directories */
+	name = strrchr(path, '/');
+	name = name ? name + 1 : (char *)path;
+
+	if (mkdir(dest, 0755) && errno != EEXIST) {
+		ret = -errno;
+		printe("Cannot create %s.\n", dest);
+		goto free_ctx;
+	}
+
+	if (i.base->inode_type == SQUASHFS_DIR_TYPE ||
+	    i.base->inode_type == SQUASHFS_LDIR_TYPE) {
+		out = strdup(dest);
+	} else {
+		out = malloc(strlen(dest) + strlen(name) + 2);
+		if (out)
+			sprintf(out, "%s/%s", dest, name);
+	}
+
+	if (!out) {
+		ret = -ENOMEM;
+		goto free_ctx;
+	}
+
+	/* Each worker may hold a fragment block while others fill theirs */
+	if (threads > SQFS_FRAG_CACHE_ENTRIES / 2) {
+		sqfs_frag_cache_free(&ctx.frag_cache);
+		ret = sqfs_frag_cache_init(&ctx.frag_cache, &ctx, 2 * threads);
+		if (ret) {
+			free(out);
+			goto free_ctx;
+		}
+	}
+
+	ex.decomps = calloc(threads, sizeof(*ex.decomps));
+	ex.buffers = calloc(threads, sizeof(*ex.buffers));
+	ex.readers = calloc(threads, sizeof(*ex.readers));
+	if (!ex.decomps || !ex.buffers || !ex.readers) {
+		printe("%s: Memory allocation error.\n", __func__);
+		ret = -ENOMEM;
+		free(out);
+		goto free_buffers;
+	}
+
+	for (k = 0; k < threads; k++) {
+		ex.buffers[k] = sqfs_buf_get(&ctx.buffers);
+		if (!ex.buffers[k]) {
+			ret = -ENOMEM;
+			free(out);
+			goto free_decomps;
+		}
+
+		ret = sqfs_decomp_dup(&ex.decomps[k], &ctx.decomp);
+		if (ret) {
+			free(out);
+			goto free_decomps;
+		}
+
+		ret = sqfs_block_reader_init(&ex.readers[k], &ctx, true);
+		if (ret) {
+			sqfs_decomp_free(&ex.decomps[k]);
+			free(out);
+			goto free_decomps;
+		}
+	}
+
+	ret = sqfs_pool_init(&ex.pool, threads);
+	if (ret) {
+		free(out);
+		goto free_decomps;
+	}
+
+	pthread_mutex_init(&ex.plan_lock, NULL);
+
+	/*
+	 * Each data block is read once, roughly in the order of the image:
+	 * let the kernel read ahead, and release the blocks behind us so that
+	 * extracting a large image does not fill the page cache.
+	 */
+	sqfs_image_advise(img, 0, img->size, SQFS_ADVICE_SEQUENTIAL);
+	img->drop_behind = true;
+
+	/* Create the tree, then write the tail ends, fragment by fragment */
+	ret = sqfs_extract_entry(&ex, &i, out);
+	sqfs_pool_wait(&ex.pool);
+	if (!ret && !ex.error) {
+		ret = sqfs_extract_plan_run(&ex);
+		sqfs_pool_wait(&ex.pool);
+	}
+
+	if (!ret && !ex.error)
+		ret = sqfs_extract_dir_modes(&ex);
+
+	sqfs_pool_free(&ex.pool);
+	pthread_mutex_destroy(&ex.plan_lock);
+
+	if (!ret)
+		ret = ex.error;
+
+free_decomps:
+	while (k--) {
+		sqfs_block_reader_free(&ex.readers[k]);
+		sqfs_decomp_free(&ex.decomps[k]);
+	}
+	img->drop_behind = false;
+free_buffers:
+	free(ex.readers);
+	for (k = 0; ex.buffers && k < threads; k++)
+		sqfs_buf_put(&ctx.buffers, ex.buffers[k]);
+	free(ex.buffers);
+	free(ex.decomps);
+	while (ex.owner_count--)
+		free(ex.owners[ex.owner_count].path);
+	free(ex.owners);
+	while (ex.dir_count--)
+		free(ex.dirs[ex.dir_count].path);
+	free(ex.dirs);
+free_ctx:
+	sqfs_ctx_free(&ctx);
+
+	return ret;
+}
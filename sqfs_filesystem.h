@@ -10,8 +10,17 @@
 #ifndef SQFS_FILESYSTEM_H
 #define SQFS_FILESYSTEM_H
 
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
 
+#include "sqfs_arena.h"
+#include "sqfs_bufpool.h"
+#include "sqfs_decompressor.h"
+#include "sqfs_image.h"
+#include "sqfs_uring.h"
 #include "sqfs_utils.h"
 
 /* Inode table */
@@ -33,6 +42,13 @@
 /* The three first members of squashfs_dir_index make a total of 12 bytes */
 #define DIR_INDEX_BASE_LENGTH 12
 #define IS_FRAGMENTED(A) ((A) != 0xFFFFFFFF)
+/* A block list entry of 0 stands for a block full of zeros (a hole) */
+#define IS_SPARSE_BLOCK(A) ((A) == 0)
+/* Block list entries: on-disk size, bit 24 being set for raw blocks */
+#define COMPRESSED_DATABLOCK(A) (!((A) & BIT(24)))
+#define DATABLOCK_SIZE(A) ((A) & GENMASK(23, 0))
+/* Unused table start (e.g. no xattr or export table) */
+#define SQUASHFS_INVALID_BLK 0xFFFFFFFFFFFFFFFFUL
 
 struct squashfs_dir_index {
 	__le32 index;
@@ -187,10 +203,34 @@ struct inode_reference {
 	__le32 offset;
 };
 
-int sqfs_dump_inode_table(void *file_mapping);
+/*
+ * Location of an inode in the uncompressed inode table: 'block' is the index
+ * of its metadata block in the table, not an on-disk offset, so the inode is
+ * found at block * METADATA_BLOCK_SIZE + offset without any search.
+ */
+struct sqfs_inode_loc {
+	uint32_t block;
+	uint16_t offset;
+	/* Zero when no inode with this number was found */
+	uint16_t type;
+};
+
+/* Dense inode number -> location array, 'locs[n - 1]' describes inode n */
+struct sqfs_inode_index {
+	uint32_t count;
+	struct sqfs_inode_loc *locs;
+};
 
-void *sqfs_find_inode(void *inode_table, int inode_number, int inode_count,
-		      uint32_t block_size);
+struct sqfs_meta_table;
+struct sqfs_ctx;
+
+int sqfs_dump_inode_table(struct sqfs_image *img);
+
+void *sqfs_read_inode(struct sqfs_meta_table *inode_table, uint64_t pos,
+		      uint32_t block_size, size_t *size);
+int sqfs_build_inode_index(struct sqfs_ctx *ctx);
+void *sqfs_find_inode(struct sqfs_ctx *ctx, uint32_t inode_number);
+dev_t sqfs_rdev(uint32_t rdev);
 
 /* Directory table */
 
@@ -203,7 +243,7 @@ struct directory_index {
 
 struct directory_entry {
 	uint16_t offset;
-	uint16_t inode_offset;
+	int16_t inode_offset;
 	uint16_t type;
 	uint16_t name_size;
 	char name[0];
@@ -215,14 +255,50 @@ struct directory_header {
 	uint32_t inode_number;
 };
 
-int sqfs_dump_directory_table(void *file_mapping);
-int sqfs_dump_entry(void *file_mapping, char *path);
-int sqfs_get_dir_offset(union squashfs_inode *i);
+/* A header is followed by at most 256 entries */
+#define SQUASHFS_DIR_COUNT 256
+/* Longest entry name */
+#define SQUASHFS_NAME_LEN 256
+
+int sqfs_dump_directory_table(struct sqfs_image *img);
+int sqfs_dump_entry(struct sqfs_image *img, char *path, int threads);
+int sqfs_resolve_path(struct sqfs_ctx *ctx, char *path,
+		      union squashfs_inode *i);
+int sqfs_extract(struct sqfs_image *img, const char *path, const char *dest,
+		 int threads);
+
+/* Directory entry, as returned by sqfs_dir_iter_next() */
+struct sqfs_dirent {
+	/* Not null-terminated */
+	const char *name;
+	size_t name_length;
+	uint16_t type;
+	uint32_t inode_number;
+	uint64_t inode_ref;
+};
+
+/* Walks the whole listing of a directory, across headers and blocks */
+struct sqfs_dir_iter {
+	struct sqfs_meta_table *dir_table;
+	struct directory_header *header;
+	/* Entries left behind the current header */
+	uint32_t remaining;
+	uint64_t pos, end;
+};
+
+int sqfs_dir_iter_init(struct sqfs_dir_iter *iter,
+		       struct sqfs_meta_table *dir_table,
+		       union squashfs_inode *dir);
+int sqfs_dir_iter_next(struct sqfs_dir_iter *iter, struct sqfs_dirent *dirent);
+uint32_t sqfs_get_parent_inode(union squashfs_inode *i);
+int sqfs_dir_lookup(struct sqfs_ctx *ctx, union squashfs_inode *dir,
+		    const char *name, struct directory_header **header,
+		    struct directory_entry **entry);
 int sqfs_dump_dir(union squashfs_inode *dir, union squashfs_inode *parent,
-		  void *inode_table, void *dir_table);
+		  struct sqfs_meta_table *dir_table);
 void sqfs_print_dir_name(union squashfs_inode *dir,
 			 union squashfs_inode *parent,
-			 void *inode_table, void *dir_table);
+			 struct sqfs_meta_table *dir_table);
 bool sqfs_is_empty_dir(union squashfs_inode *i);
 
 /* Fragment table */
@@ -233,15 +309,278 @@ struct fragment_block_entry {
 	uint32_t _unused;
 };
 
+int sqfs_frag_lookup(struct sqfs_ctx *ctx, uint32_t inode_fragment,
+		     struct fragment_block_entry *e);
+int sqfs_read_fragment(struct sqfs_ctx *ctx, struct sqfs_decomp *decomp,
+		       struct fragment_block_entry *e, unsigned char *buffer,
+		       unsigned char **data, size_t *size);
+
+/*
+ * Cache of decompressed fragment blocks, keyed by fragment index and shared by
+ * threads. An entry is pinned while referenced: sqfs_frag_cache_get() takes a
+ * reference, released by sqfs_frag_cache_put(). Only unreferenced entries
+ * are recycled, least recently used first.
+ */
+#define SQFS_FRAG_CACHE_ENTRIES 8
+#define SQFS_FRAG_NONE 0xFFFFFFFF
+
+struct sqfs_frag_cache_entry {
+	uint32_t fragment;
+	int refs;
+	/* Set once 'data' is filled, or decompression failed */
+	bool ready;
+	int error;
+	/* Points to 'buffer', or into the image if stored uncompressed */
+	unsigned char *data;
+	size_t size;
+	unsigned char *buffer;
+	/* Hash bucket chaining */
+	struct sqfs_frag_cache_entry *hnext;
+	/* LRU list of unreferenced entries, most recently used first */
+	struct sqfs_frag_cache_entry *prev, *next;
+};
+
+struct sqfs_frag_cache {
+	struct sqfs_ctx *ctx;
+	int capacity;
+	struct sqfs_frag_cache_entry *entries;
+	struct sqfs_frag_cache_entry **buckets;
+	int bucket_count;
+	struct sqfs_frag_cache_entry *head, *tail;
+	unsigned long hits, misses;
+	pthread_mutex_t lock;
+	/* Signaled when an entry gets ready or unreferenced */
+	pthread_cond_t cond;
+};
+
+int sqfs_frag_cache_init(struct sqfs_frag_cache *cache, struct sqfs_ctx *ctx,
+			 int capacity);
+void sqfs_frag_cache_free(struct sqfs_frag_cache *cache);
+int sqfs_frag_cache_get(struct sqfs_frag_cache *cache,
+			struct sqfs_decomp *decomp, uint32_t fragment,
+			struct sqfs_frag_cache_entry **entry);
+void sqfs_frag_cache_put(struct sqfs_frag_cache *cache,
+			 struct sqfs_frag_cache_entry *e);
+
+/* File data */
+
+/* Where the content of a regular file (basic or extended) is stored */
+struct sqfs_file {
+	uint64_t file_size;
+	/* Absolute offset of the first data block */
+	uint64_t start_block;
+	/* On-disk size of each data block */
+	uint32_t *block_list;
+	uint64_t block_count;
+	/* Tail end location, if 'fragment' is valid */
+	uint32_t fragment;
+	uint32_t frag_offset;
+};
+
+struct sqfs_sink;
+
+uint64_t sqfs_count_blocks(uint64_t file_size, uint32_t fragment,
+			   uint32_t block_size);
+int sqfs_file_init(struct sqfs_ctx *ctx, union squashfs_inode *i,
+		   struct sqfs_file *file);
+int sqfs_decode_datablock(struct sqfs_ctx *ctx, struct sqfs_decomp *decomp,
+			  uint32_t entry, const void *src,
+			  unsigned char *buffer, unsigned char **data,
+			  size_t *size);
+int sqfs_read_datablock(struct sqfs_ctx *ctx, struct sqfs_decomp *decomp,
+			uint64_t offset, uint32_t entry, unsigned char *buffer,
+			unsigned char **data, size_t *size);
+
+/*
+ * Reads a range of data blocks of a file in order, ahead of their use: on
+ * io_uring images, up to 'depth' reads are kept in flight while the caller
+ * decompresses. Otherwise, each block is read (or pointed to in the image)
+ * when asked for. Sparse blocks, and raw ones if 'skip_raw' is set, are not
+ * read, and are skipped by sqfs_block_reader_next().
+ *
+ * As the block list gives the whole range in advance, the kernel is asked to
+ * fetch it SQFS_IMAGE_READAHEAD bytes ahead and, if the image has
+ * 'drop_behind' set, to release what was read.
+ */
+struct sqfs_block_reader {
+	struct sqfs_ctx *ctx;
+	bool skip_raw;
+	bool async;
+	struct sqfs_uring ring;
+	int depth;
+	/* Buffer of each slot, only if reading asynchronously */
+	unsigned char **buffers;
+	/* Location, size and read status of the block held by each slot */
+	uint64_t *offsets;
+	size_t *sizes;
+	int *results;
+	bool *ready;
+	/* Queued blocks use slots [head, head + count), modulo 'depth' */
+	int head, count, inflight;
+	/* Set once the block at 'head' has been handed out */
+	bool held;
+	/* Blocks left to queue */
+	const uint32_t *block_list;
+	uint64_t next_block, end_block, next_offset;
+	/* End of the range in the image, fetched by the kernel up to 'advised' */
+	uint64_t end_offset, advised;
+	/* Data read but not released yet, which may span successive ranges */
+	uint64_t drop_start, drop_end;
+};
+
+int sqfs_block_reader_init(struct sqfs_block_reader *r, struct sqfs_ctx *ctx,
+			   bool skip_raw);
+void sqfs_block_reader_free(struct sqfs_block_reader *r);
+int sqfs_block_reader_start(struct sqfs_block_reader *r,
+			    struct sqfs_file *file, uint64_t first,
+			    uint64_t count, uint64_t offset);
+int sqfs_block_reader_next(struct sqfs_block_reader *r, const void **src,
+			   size_t *size);
+int sqfs_write_file(struct sqfs_ctx *ctx, struct sqfs_file *file,
+		    struct sqfs_sink *sink);
+
 /* Export table */
 
+/*
+ * Inode references pack the on-disk offset of the inode's metadata block
+ * (relative to the inode table) with the offset inside the uncompressed block
+ */
+#define SQUASHFS_INODE_BLK(A) ((uint32_t)((A) >> 16))
+#define SQUASHFS_INODE_OFFSET(A) ((uint16_t)((A) & 0xFFFF))
+/* Each metadata block of the export table holds 1024 inode references */
+#define SQUASHFS_LOOKUP_ENTRIES (METADATA_BLOCK_SIZE / sizeof(uint64_t))
+
+int sqfs_export_lookup(struct sqfs_ctx *ctx, uint32_t inode_number,
+		       uint64_t *ref);
+void *sqfs_read_inode_ref(struct sqfs_ctx *ctx, uint64_t ref);
+
 /* uid/gid lookup table */
 
+/* Each metadata block of the id table holds 2048 ids */
+#define SQUASHFS_ID_ENTRIES (METADATA_BLOCK_SIZE / sizeof(uint32_t))
+
+int sqfs_id_lookup(struct sqfs_ctx *ctx, uint16_t index, uint32_t *id);
+
 /* xattr table */
 
 /* Metadata blocks */
 
-int sqfs_read_metablock(void *file_mapping, int offset, bool *compressed,
-			size_t *data_size);
+/*
+ * Uncompressed view of a chain of metadata blocks (inode or directory table).
+ * Once uncompressed, every block but the last one holds exactly
+ * METADATA_BLOCK_SIZE bytes, so the k-th block is stored at
+ * k * METADATA_BLOCK_SIZE in 'data' and entries crossing a block boundary are
+ * contiguous. Blocks are only decompressed the first time they are accessed.
+ */
+struct sqfs_meta_table {
+	struct sqfs_image *image;
+	struct sqfs_decomp *decomp;
+	/* Absolute offset of the first metadata block */
+	uint64_t start;
+	/* On-disk offset of each block, relative to 'start' */
+	uint32_t *block_offsets;
+	bool *loaded;
+	int block_count;
+	unsigned char *data;
+	/* Uncompressed size, exact once the last block has been read */
+	size_t size;
+};
+
+int sqfs_read_metablock(struct sqfs_image *img, uint64_t offset,
+			bool *compressed, size_t *data_size);
+int sqfs_meta_table_init(struct sqfs_meta_table *table,
+			 struct sqfs_image *img, struct sqfs_decomp *decomp,
+			 struct sqfs_arena *arena, uint64_t start,
+			 uint64_t end);
+int sqfs_meta_table_load_all(struct sqfs_meta_table *table);
+int64_t sqfs_meta_table_pos(struct sqfs_meta_table *table, uint32_t block,
+			    uint16_t offset);
+void *sqfs_meta_table_at(struct sqfs_meta_table *table, uint64_t pos,
+			 size_t size);
+void *sqfs_meta_table_get(struct sqfs_meta_table *table, uint32_t block,
+			  uint16_t offset, size_t size);
+
+/*
+ * LRU cache of decompressed metadata blocks, keyed by their absolute offset in
+ * the image. Used for tables read at random (fragment and export tables),
+ * where the same few blocks are needed again and again.
+ */
+#define SQFS_META_CACHE_ENTRIES 16
+
+struct sqfs_meta_cache_entry {
+	uint64_t offset;
+	size_t size;
+	unsigned char *data;
+	/* Hash bucket chaining */
+	struct sqfs_meta_cache_entry *hnext;
+	/* LRU list, most recently used first */
+	struct sqfs_meta_cache_entry *prev, *next;
+};
+
+struct sqfs_meta_cache {
+	struct sqfs_image *image;
+	struct sqfs_decomp *decomp;
+	int capacity, count;
+	struct sqfs_meta_cache_entry *entries;
+	unsigned char *blocks;
+	struct sqfs_meta_cache_entry **buckets;
+	int bucket_count;
+	struct sqfs_meta_cache_entry *head, *tail;
+	unsigned long hits, misses;
+};
+
+int sqfs_meta_cache_init(struct sqfs_meta_cache *cache,
+			 struct sqfs_image *img, struct sqfs_decomp *decomp,
+			 struct sqfs_arena *arena, int capacity);
+void *sqfs_meta_cache_get(struct sqfs_meta_cache *cache, uint64_t offset,
+			  size_t *size);
+
+/* File content output */
+
+struct iovec;
+
+/*
+ * Destination of a file's content. Writes are truncated once 'remaining'
+ * bytes have been written, so callers may hand over whole blocks.
+ */
+struct sqfs_sink {
+	int fd;
+	uint64_t remaining;
+};
+
+void sqfs_sink_init(struct sqfs_sink *sink, int fd, uint64_t size);
+int sqfs_sink_write(struct sqfs_sink *sink, const void *buf, size_t len);
+int sqfs_sink_writev(struct sqfs_sink *sink, struct iovec *iov, int iovcnt);
+int sqfs_pwrite(int fd, const void *buf, size_t len, uint64_t offset);
+int sqfs_copy_range(int fd_in, uint64_t off_in, int fd_out, uint64_t off_out,
+		    size_t len);
+
+/* Per-image state shared by the table parsers */
+
+struct sqfs_ctx {
+	struct sqfs_image *image;
+	struct squashfs_super_block *sblk;
+	struct super_block_flags sblkf;
+	struct sqfs_decomp decomp;
+	struct sqfs_meta_table inode_table;
+	struct sqfs_meta_table dir_table;
+	struct sqfs_meta_cache meta_cache;
+	struct sqfs_frag_cache frag_cache;
+	/* Built on the first inode lookup by number */
+	struct sqfs_inode_index inode_index;
+	/*
+	 * Backs the tables, the metadata cache, the inode index and the path
+	 * tokens, until sqfs_ctx_free(). Only used by the thread which set
+	 * up the context: extraction workers do not allocate from it.
+	 */
+	struct sqfs_arena arena;
+	/* Data and fragment block buffers, shared by all threads */
+	struct sqfs_buf_pool buffers;
+	/* Number of threads decompressing data blocks */
+	int threads;
+};
+
+int sqfs_ctx_init(struct sqfs_ctx *ctx, struct sqfs_image *img);
+void sqfs_ctx_free(struct sqfs_ctx *ctx);
 
 #endif /* SQFS_FILESYSTEM_H */
@@ -0,0 +1,499 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Bootlin
+ *
+ * Author: Joao Marcos Costa <joaomarcos.costa@bootlin.com>
+ *
+ * sqfs_image.c: read the image through mmap(2), pread(2) or a memory buffer
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sqfs_image.h"
+#include "sqfs_utils.h"
+
+/* Initial buffer size when loading an image of unknown size */
+#define SQFS_IMAGE_CHUNK (1 << 20)
+
+/* Set by the sqfs program, left unset in libsqfs */
+bool sqfs_print_errors;
+
+/* Backing buffer of the views, one per thread */
+struct sqfs_staging {
+	size_t size;
+	unsigned char data[];
+};
+
+/*
+ * Map 'size' bytes at an address aligned on SQFS_HUGE_PAGE_SIZE, so that they
+ * can be backed by whole huge pages, and ask for them. The mapping spans the
+ * rest of its last huge page, which is left inaccessible.
+ */
+static void *sqfs_huge_map(size_t size, int prot, int flags, int fd)
+{
+	size_t len = ALIGN(size, SQFS_HUGE_PAGE_SIZE);
+	unsigned char *area, *p;
+
+	/* Reserve enough address space to align the mapping */
+	area = mmap(NULL, len + SQFS_HUGE_PAGE_SIZE, PROT_NONE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (area == MAP_FAILED)
+		return MAP_FAILED;
+
+	p = (unsigned char *)ALIGN((uintptr_t)area, SQFS_HUGE_PAGE_SIZE);
+	if (p != area)
+		munmap(area, p - area);
+	munmap(p + len, SQFS_HUGE_PAGE_SIZE - (p - area));
+
+	if (mmap(p, size, prot, flags | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(p, len);
+		return MAP_FAILED;
+	}
+
+	/* Only a hint: transparent huge pages may be disabled */
+	madvise(p, len, MADV_HUGEPAGE);
+
+	return p;
+}
+
+/* Anonymous memory aligned on huge pages, NULL on error */
+void *sqfs_huge_alloc(size_t size)
+{
+	void *p;
+
+	p = sqfs_huge_map(size, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS, -1);
+
+	return p == MAP_FAILED ? NULL : p;
+}
+
+void sqfs_huge_free(void *ptr, size_t size)
+{
+	if (ptr)
+		munmap(ptr, ALIGN(size, SQFS_HUGE_PAGE_SIZE));
+}
+
+static int sqfs_mem_read(struct sqfs_image *img, void *buf, size_t len,
+			 uint64_t offset)
+{
+	memcpy(buf, img->base + offset, len);
+
+	return 0;
+}
+
+static void sqfs_mmap_close(struct sqfs_image *img)
+{
+	if (img->huge_pages)
+		sqfs_huge_free(img->base, img->size);
+	else
+		munmap(img->base, img->size);
+}
+
+static void sqfs_mem_close(struct sqfs_image *img)
+{
+	if (img->huge_pages)
+		sqfs_huge_free(img->base, img->size);
+	else
+		free(img->base);
+}
+
+static int sqfs_pread_read(struct sqfs_image *img, void *buf, size_t len,
+			   uint64_t offset)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = pread(img->fd, buf, len, offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			printe("%s: Read error at 0x%lx.\n", __func__, offset);
+			return -errno;
+		}
+
+		/* The device shrank under our feet */
+		if (!ret)
+			return -EIO;
+
+		buf += ret;
+		offset += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static void sqfs_pread_close(struct sqfs_image *img)
+{
+	free(img->head);
+}
+
+static void sqfs_fd_advise(struct sqfs_image *img, uint64_t offset,
+			   uint64_t len, enum sqfs_image_advice advice)
+{
+	static const int fadvice[] = {
+		[SQFS_ADVICE_SEQUENTIAL] = POSIX_FADV_SEQUENTIAL,
+		[SQFS_ADVICE_WILLNEED] = POSIX_FADV_WILLNEED,
+		[SQFS_ADVICE_DONTNEED] = POSIX_FADV_DONTNEED,
+	};
+
+	/* Only hints: errors are not worth reporting */
+	posix_fadvise(img->fd, offset, len, fadvice[advice]);
+}
+
+static void sqfs_mmap_advise(struct sqfs_image *img, uint64_t offset,
+			     uint64_t len, enum sqfs_image_advice advice)
+{
+	static const int madvice[] = {
+		[SQFS_ADVICE_SEQUENTIAL] = MADV_SEQUENTIAL,
+		[SQFS_ADVICE_WILLNEED] = MADV_WILLNEED,
+		[SQFS_ADVICE_DONTNEED] = MADV_DONTNEED,
+	};
+	uint64_t page = sysconf(_SC_PAGESIZE);
+	uint64_t start, end;
+
+	/*
+	 * madvise() wants whole pages: widen the range to fetch, but narrow
+	 * the one to drop, its first and last pages being shared with the
+	 * neighbouring blocks.
+	 */
+	if (advice == SQFS_ADVICE_DONTNEED) {
+		start = (offset + page - 1) & ~(page - 1);
+		end = (offset + len) & ~(page - 1);
+	} else {
+		start = offset & ~(page - 1);
+		end = offset + len;
+	}
+
+	if (end <= start)
+		return;
+
+	madvise(img->base + start, end - start, madvice[advice]);
+
+	/* Unmapping the pages does not remove them from the page cache */
+	if (advice == SQFS_ADVICE_DONTNEED)
+		sqfs_fd_advise(img, start, end - start, advice);
+}
+
+static const struct sqfs_image_ops sqfs_mmap_ops = {
+	.name = "mmap",
+	.read = sqfs_mem_read,
+	.close = sqfs_mmap_close,
+	.advise = sqfs_mmap_advise,
+};
+
+static const struct sqfs_image_ops sqfs_pread_ops = {
+	.name = "pread",
+	.read = sqfs_pread_read,
+	.close = sqfs_pread_close,
+	.advise = sqfs_fd_advise,
+};
+
+/* Same as pread, sqfs_block_reader uses io_uring for the data blocks */
+static const struct sqfs_image_ops sqfs_uring_ops = {
+	.name = "io_uring",
+	.read = sqfs_pread_read,
+	.close = sqfs_pread_close,
+	.advise = sqfs_fd_advise,
+};
+
+static const struct sqfs_image_ops sqfs_mem_ops = {
+	.name = "memory",
+	.read = sqfs_mem_read,
+	.close = sqfs_mem_close,
+};
+
+/* Same as realloc(3), for the buffer of an image loaded into memory */
+static void *sqfs_image_realloc(struct sqfs_image *img, void *buf,
+				size_t capacity, size_t new_capacity)
+{
+	void *p;
+
+	if (!img->huge_pages)
+		return realloc(buf, new_capacity);
+
+	p = sqfs_huge_alloc(new_capacity);
+	if (p && buf) {
+		memcpy(p, buf, capacity);
+		sqfs_huge_free(buf, capacity);
+	}
+
+	return p;
+}
+
+/* Read the whole content of 'fd' into memory, its size being unknown */
+static int sqfs_image_load(struct sqfs_image *img, int fd)
+{
+	unsigned char *buf = NULL, *p;
+	size_t capacity = 0, next, used;
+	ssize_t ret;
+
+	for (;;) {
+		if (img->size == capacity) {
+			next = capacity ? 2 * capacity : SQFS_IMAGE_CHUNK;
+			p = sqfs_image_realloc(img, buf, capacity, next);
+			if (!p) {
+				printe("%s: Memory allocation error.\n",
+				       __func__);
+				ret = -ENOMEM;
+				goto free_buf;
+			}
+
+			buf = p;
+			capacity = next;
+		}
+
+		ret = read(fd, buf + img->size, capacity - img->size);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			printe("%s: Read error.\n", __func__);
+			ret = -errno;
+			goto free_buf;
+		}
+
+		if (!ret)
+			break;
+
+		img->size += ret;
+		img->reads++;
+		img->bytes_read += ret;
+	}
+
+	/* sqfs_mem_close() only knows about the image size */
+	used = ALIGN(img->size, SQFS_HUGE_PAGE_SIZE);
+	if (img->huge_pages && used < ALIGN(capacity, SQFS_HUGE_PAGE_SIZE))
+		munmap(buf + used, ALIGN(capacity, SQFS_HUGE_PAGE_SIZE) - used);
+
+	img->base = buf;
+
+	return 0;
+
+free_buf:
+	if (img->huge_pages)
+		sqfs_huge_free(buf, capacity);
+	else
+		free(buf);
+
+	return ret;
+}
+
+static int sqfs_image_setup(struct sqfs_image *img, struct stat *st,
+			    enum sqfs_image_mode mode)
+{
+	off_t size;
+	int ret;
+
+	if (mode == SQFS_IMAGE_MEMORY) {
+		img->ops = &sqfs_mem_ops;
+		ret = sqfs_image_load(img, img->fd);
+		close(img->fd);
+		img->fd = -1;
+
+		return ret;
+	}
+
+	/* The size of block devices is only given by lseek(2) */
+	size = S_ISREG(st->st_mode) ? st->st_size :
+	       lseek(img->fd, 0, SEEK_END);
+	if (size < 0) {
+		printe("Cannot get the size of the image.\n");
+		return -errno;
+	}
+
+	img->size = size;
+	if (img->size < SUPER_BLOCK_SIZE)
+		return 0;
+
+	if (mode == SQFS_IMAGE_MMAP) {
+		img->ops = &sqfs_mmap_ops;
+		if (img->huge_pages)
+			img->base = sqfs_huge_map(img->size, PROT_READ,
+						  MAP_PRIVATE, img->fd);
+		else
+			img->base = mmap(NULL, img->size, PROT_READ,
+					 MAP_PRIVATE, img->fd, 0);
+		if (img->base == MAP_FAILED) {
+			img->base = NULL;
+			printe("Error: file could not be mapped\n");
+			return -errno;
+		}
+
+		return 0;
+	}
+
+	if (mode == SQFS_IMAGE_URING) {
+		img->ops = &sqfs_uring_ops;
+		img->queue_depth = SQFS_IMAGE_QUEUE_DEPTH;
+	} else {
+		img->ops = &sqfs_pread_ops;
+	}
+
+	img->head = calloc(1, SQFS_IMAGE_HEAD_SIZE);
+	if (!img->head)
+		return -ENOMEM;
+
+	return sqfs_pread_read(img, img->head,
+			       img->size < SQFS_IMAGE_HEAD_SIZE ?
+			       img->size : SQFS_IMAGE_HEAD_SIZE, 0);
+}
+
+/*
+ * Open the image at 'path', "-" standing for the standard input. With
+ * SQFS_IMAGE_AUTO, regular files are mapped, block devices are read with
+ * pread(2) and anything else (pipes, sockets...) is loaded into memory.
+ * 'flags' is a set of enum sqfs_image_flags.
+ */
+int sqfs_image_open(struct sqfs_image *img, const char *path,
+		    enum sqfs_image_mode mode, unsigned int flags)
+{
+	struct stat st;
+	int ret;
+
+	memset(img, 0, sizeof(*img));
+	img->huge_pages = flags & SQFS_IMAGE_HUGE_PAGES;
+	img->fd = strcmp(path, "-") ? open(path, O_RDONLY) :
+		  dup(STDIN_FILENO);
+	if (img->fd < 0) {
+		printe("No such file or directory\n");
+		return -errno;
+	}
+
+	if (fstat(img->fd, &st)) {
+		ret = -errno;
+		goto close_fd;
+	}
+
+	if (mode == SQFS_IMAGE_AUTO) {
+		if (S_ISREG(st.st_mode))
+			mode = SQFS_IMAGE_MMAP;
+		else if (S_ISBLK(st.st_mode))
+			mode = SQFS_IMAGE_PREAD;
+		else
+			mode = SQFS_IMAGE_MEMORY;
+	}
+
+	ret = sqfs_image_setup(img, &st, mode);
+	if (ret)
+		goto free_image;
+
+	if (img->size < SUPER_BLOCK_SIZE) {
+		printe("Error: image too small\n");
+		ret = -EINVAL;
+		goto free_image;
+	}
+
+	if (img->base)
+		img->head = img->base;
+
+	ret = -pthread_key_create(&img->staging, free);
+	if (ret)
+		goto free_image;
+
+	printd("Image source: %s, %lu bytes%s\n", img->ops->name, img->size,
+	       img->huge_pages ? ", huge pages" : "");
+
+	return 0;
+
+free_image:
+	if (img->ops && (img->base || img->head))
+		img->ops->close(img);
+close_fd:
+	if (img->fd >= 0)
+		close(img->fd);
+
+	return ret;
+}
+
+void sqfs_image_close(struct sqfs_image *img)
+{
+	/* The other threads free theirs when exiting */
+	free(pthread_getspecific(img->staging));
+	pthread_setspecific(img->staging, NULL);
+	pthread_key_delete(img->staging);
+
+	printd("Image: %lu reads, %lu bytes read\n", img->reads,
+	       img->bytes_read);
+
+	img->ops->close(img);
+	if (img->fd >= 0)
+		close(img->fd);
+}
+
+/* Copy 'len' bytes of the image at 'offset' to 'buf' */
+int sqfs_image_read(struct sqfs_image *img, void *buf, size_t len,
+		    uint64_t offset)
+{
+	if (offset > img->size || len > img->size - offset) {
+		printe("%s: Read past the end of the image.\n", __func__);
+		return -EIO;
+	}
+
+	if (!img->base) {
+		__atomic_add_fetch(&img->reads, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&img->bytes_read, len, __ATOMIC_RELAXED);
+	}
+
+	return img->ops->read(img, buf, len, offset);
+}
+
+/*
+ * Return a pointer to 'len' bytes of the image at 'offset', or NULL on error.
+ * Unless the image is in memory, the data is read into a buffer owned by the
+ * calling thread, which is only valid until its next call.
+ */
+const void *sqfs_image_view(struct sqfs_image *img, uint64_t offset,
+			    size_t len)
+{
+	struct sqfs_staging *s, *p;
+
+	if (img->base) {
+		if (offset > img->size || len > img->size - offset) {
+			printe("%s: Read past the end of the image.\n",
+			       __func__);
+			return NULL;
+		}
+
+		return img->base + offset;
+	}
+
+	s = pthread_getspecific(img->staging);
+	if (!s || s->size < len) {
+		p = realloc(s, sizeof(*s) + len);
+		if (!p) {
+			printe("%s: Memory allocation error.\n", __func__);
+			return NULL;
+		}
+
+		s = p;
+		s->size = len;
+		pthread_setspecific(img->staging, s);
+	}
+
+	if (sqfs_image_read(img, s->data, len, offset))
+		return NULL;
+
+	return s->data;
+}
+
+/* Tell the kernel how a range of the image is going to be accessed */
+void sqfs_image_advise(struct sqfs_image *img, uint64_t offset, uint64_t len,
+		       enum sqfs_image_advice advice)
+{
+	/* A null length would stand for the whole file to posix_fadvise() */
+	if (!img->ops->advise || !len || offset >= img->size)
+		return;
+
+	if (len > img->size - offset)
+		len = img->size - offset;
+
+	img->ops->advise(img, offset, len, advice);
+}
@@ -0,0 +1,116 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2020 Bootlin
+ *
+ * Author: Joao Marcos Costa <joaomarcos.costa@bootlin.com>
+ *
+ * sqfs_image.h:	image sources (mmap, pread or memory buffer), included at
+ *			sqfs_filesystem.h
+ */
+
+#ifndef SQFS_IMAGE_H
+#define SQFS_IMAGE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum sqfs_image_mode {
+	/* mmap for regular files, pread for devices, memory for pipes */
+	SQFS_IMAGE_AUTO,
+	SQFS_IMAGE_MMAP,
+	SQFS_IMAGE_PREAD,
+	SQFS_IMAGE_MEMORY,
+	/* pread, data blocks being read ahead with io_uring */
+	SQFS_IMAGE_URING,
+};
+
+/* Superblock and compression options, always kept in memory */
+#define SQFS_IMAGE_HEAD_SIZE 128
+/* Default number of data block reads in flight, per thread */
+#define SQFS_IMAGE_QUEUE_DEPTH 32
+/* How far ahead of the reads the kernel is asked to fetch the data */
+#define SQFS_IMAGE_READAHEAD (1 << 20)
+/*
+ * Data read is released in steps of this size: the page cache may use large
+ * folios, which are only dropped once entirely covered
+ */
+#define SQFS_IMAGE_DROP_BEHIND (8 << 20)
+
+/* Alignment of the regions which transparent huge pages may back */
+#define SQFS_HUGE_PAGE_SIZE (2 << 20)
+
+/* Options of sqfs_image_open() */
+enum sqfs_image_flags {
+	/* Map or load the image, and allocate block buffers, on huge pages */
+	SQFS_IMAGE_HUGE_PAGES = 1 << 0,
+};
+
+/* Access hints, forwarded to madvise(2) or posix_fadvise(2) */
+enum sqfs_image_advice {
+	/* The range is read from start to end */
+	SQFS_ADVICE_SEQUENTIAL,
+	/* The range is about to be read */
+	SQFS_ADVICE_WILLNEED,
+	/* The range was read and will not be needed again */
+	SQFS_ADVICE_DONTNEED,
+};
+
+struct sqfs_image;
+
+struct sqfs_image_ops {
+	const char *name;
+	/* Read exactly 'len' bytes at 'offset', already checked to fit */
+	int (*read)(struct sqfs_image *img, void *buf, size_t len,
+		    uint64_t offset);
+	void (*close)(struct sqfs_image *img);
+	/* Optional, 'offset' and 'len' being already checked to fit */
+	void (*advise)(struct sqfs_image *img, uint64_t offset, uint64_t len,
+		       enum sqfs_image_advice advice);
+};
+
+/*
+ * Read-only access to a SquashFS image. Every table reader goes through
+ * sqfs_image_read(), which copies, or sqfs_image_view(), which does not copy
+ * whenever the whole image is in memory ('base' is set). Accesses past the end
+ * of the image and I/O errors are reported as -EIO.
+ */
+struct sqfs_image {
+	const struct sqfs_image_ops *ops;
+	/* -1 if the image was read from a pipe */
+	int fd;
+	uint64_t size;
+	/* Whole image, unless it is read with pread(2) */
+	unsigned char *base;
+	/* 'base' and the block buffers are aligned on huge pages */
+	bool huge_pages;
+	/* Start of the image: points to 'base', or to a copy */
+	unsigned char *head;
+	/* Per-thread buffers backing the views of non-mapped images */
+	pthread_key_t staging;
+	/* Data block reads kept in flight with io_uring, 0 if not used */
+	int queue_depth;
+	/*
+	 * Release the data blocks from the page cache once read, for scans
+	 * which do not come back to them
+	 */
+	bool drop_behind;
+	/* Number of reads and bytes read from the file */
+	unsigned long reads;
+	uint64_t bytes_read;
+};
+
+int sqfs_image_open(struct sqfs_image *img, const char *path,
+		    enum sqfs_image_mode mode, unsigned int flags);
+void sqfs_image_close(struct sqfs_image *img);
+int sqfs_image_read(struct sqfs_image *img, void *buf, size_t len,
+		    uint64_t offset);
+const void *sqfs_image_view(struct sqfs_image *img, uint64_t offset,
+			    size_t len);
+void sqfs_image_advise(struct sqfs_image *img, uint64_t offset, uint64_t len,
+		       enum sqfs_image_advice advice);
+void *sqfs_huge_alloc(size_t size);
+void sqfs_huge_free(void *ptr, size_t size);
+
+#endif /* SQFS_IMAGE_H */
@@ -8,15 +8,15 @@
  */
 
 #include <errno.h>
-#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <time.h>
-#include <zlib.h>
+#include <unistd.h>
 
 #include "sqfs_filesystem.h"
 #include "sqfs_utils.h"
@@ -25,19 +25,8 @@
 #define SIZE(obj) printf("%d\n", sizeof(struct obj))
 #define MAJOR_NUMBER_BITMASK GENMASK(15, 8)
 #define MINOR_NUMBER_BITMASK GENMASK(7, 0)
-#define LREG_INODE_MIN_SIZE 56
-#define ENTRY_BASE_LENGTH 8
 /* size of metadata (inode and directory) blocks */
 #define SQUASHFS_METADATA_SIZE	8192
-/* Max. number of fragment entries in a metadata block is 512 */
-#define MAX_ENTRIES 512
-#define SQUASHFS_FRAGMENT_BYTES(A) ((A) * sizeof(struct fragment_block_entry))
-#define SQUASHFS_FRAGMENT_INDEX(A) ((A) / MAX_ENTRIES)
-#define SQUASHFS_FRAGMENT_INDEX_OFFSET(A) ((A) % MAX_ENTRIES)
-#define SQUASHFS_UNCOMPRESSED_DATA 0x0002
-#define COMPRESSED_FRAGMENT_BLOCK(A) (!((A) & BIT(24)))
-#define FRAGMENT_BLOCK_SIZE(A) ((A) & GENMASK(23, 0))
-#define DIR_HEADER_SIZE 12
 
 static bool sqfs_is_dir(union squashfs_inode *i)
 {
@@ -46,79 +35,16 @@ static bool sqfs_is_dir(union squashfs_inode *i)
 }
 
 /*
- * Retrieves fragment block entry and returns true if the fragment block is
- * compressed
+ * Number of entries in a file's block list: the tail end of a fragmented file
+ * is stored in a fragment block instead of a data block of its own.
  */
-static bool sqfs_frag_lookup(void *file_mapping, uint32_t inode_fragment,
-			     struct fragment_block_entry *e)
+uint64_t sqfs_count_blocks(uint64_t file_size, uint32_t fragment,
+			   uint32_t block_size)
 {
-	uint64_t *fragment_index_table, start_block;
-	uint16_t *header, src_len;
-	struct fragment_block_entry *entries;
-	struct squashfs_super_block *sblk;
-	int block, offset, ret;
-	size_t dest_len;
-	void *metadata;
-
-	sblk = file_mapping;
-	block = SQUASHFS_FRAGMENT_INDEX(inode_fragment);
-	offset = SQUASHFS_FRAGMENT_INDEX_OFFSET(inode_fragment);
-
-	/* Start of the fragment index table in memory */
-	fragment_index_table = file_mapping + sblk->fragment_table_start;
-
-	/*
-	 * Get the start offset of the metadata block that contains the right
-	 * fragment_block_entry
-	 */
-	start_block = fragment_index_table[block];
-
-	/* Every metadata block starts with a 16-bit header */
-	header = file_mapping + start_block;
-	metadata = file_mapping + start_block + HEADER_SIZE;
-	printd("Header 0x%04x\n", *header);
-	src_len = DATA_SIZE(*header);
-
-	printd("Compressed data size: %u bytes\n", src_len);
-
-	if (IS_COMPRESSED(*header)) {
-		entries = malloc(METADATA_BLOCK_SIZE);
-		if (!entries) {
-			printf("%s: Memory allocation error.\n", __func__);
-			free(entries);
-			return errno;
-		}
-
-		printd("Compressed metadata block\n");
-		ret = sqfs_decompress(entries, &dest_len, metadata, src_len);
-		if (ret != Z_OK) {
-			free(entries);
-			return ret;
-		}
-
-		printd("Uncompressed size: %ld\n", dest_len);
-	} else {
-		entries = file_mapping + start_block + HEADER_SIZE;
-		printd("Uncompressed metadata block\n");
-	}
-
-	*e = *(struct fragment_block_entry *)(entries + offset);
-
-	if (IS_COMPRESSED(*header))
-		free(entries);
-
-	printd("Fragment entry:\n");
-	printd("Start: 0x%016lx\n", e->start);
+	if (IS_FRAGMENTED(fragment))
+		return file_size / block_size;
 
-	if (COMPRESSED_FRAGMENT_BLOCK(e->size))
-		printd("Compressed fragment block\n");
-	else
-		printd("Uncompressed fragment block\n");
-
-	printd("Fragment block on-disk size: %lu\n",
-	       FRAGMENT_BLOCK_SIZE(e->size));
-
-	return COMPRESSED_FRAGMENT_BLOCK(e->size);
+	return DIV_ROUND_UP(file_size, block_size);
 }
 
 static int sqfs_parse_path(char *path, bool *is_a_dir)
@@ -154,106 +80,80 @@ static int sqfs_parse_path(char *path, bool *is_a_dir)
 }
 
 static int sqfs_search_entry(union squashfs_inode *i, char **token_list,
-			     int token_count, void *inode_table,
-			     void *dir_table, int inode_count, int block_size)
+			     int token_count, struct sqfs_ctx *ctx)
 {
-	int j, k, l, name_length, total_length = 0, new_inode_number;
-	struct directory_header *parent_header;
-	struct directory_entry *dir_entry;
-	bool equals = false;
-
-	i->base = sqfs_find_inode(inode_table, inode_count, inode_count,
-				  block_size);
-
-	parent_header = dir_table + sqfs_get_dir_offset(i);
+	struct directory_header *header;
+	struct directory_entry *entry;
+	int j, ret;
 
 	for (j = 0; j < token_count; j++) {
 		printd("Searching for %s...\n", token_list[j]);
 		printd("Current inode %d\n", i->base->inode_number);
-		if (sqfs_is_dir(i)) {
-			parent_header = dir_table + sqfs_get_dir_offset(i);
-		} else {
-			printf("Entry not found\n");
+		if (!sqfs_is_dir(i)) {
+			printe("Entry not found\n");
 			return -EINVAL;
 		}
 
-		for (k = 0; k <= parent_header->count; k++) {
-			printd("%d)\n", k);
-
-			dir_entry = (void *)parent_header + DIR_HEADER_SIZE
-				+ total_length;
-
-			/* Skip comparison between different length strings */
-			name_length = dir_entry->name_size + 1;
-			if (strlen(token_list[j]) != name_length) {
-				total_length += ENTRY_BASE_LENGTH + name_length;
-				continue;
-			}
-
-			equals = true;
-			for (l = 0; l < strlen(token_list[j]); l++)
-				equals &= (dir_entry->name[l] ==
-					   token_list[j][l]);
-
-			printd("Token: %s\n", token_list[j]);
-
-			if (equals) {
-				printd("%s found\n", token_list[j]);
+		ret = sqfs_dir_lookup(ctx, i, token_list[j], &header, &entry);
+		if (ret) {
+			printe("Entry not found.\n");
+			return -EINVAL;
+		}
 
-				/* Redefine inode as the found token */
-				new_inode_number = dir_entry->inode_offset
-					+ parent_header->inode_number;
+		printd("%s found\n", token_list[j]);
 
-				i->base = sqfs_find_inode(inode_table,
-							  new_inode_number,
-							  inode_count,
-							  block_size);
-				if (sqfs_is_dir(i)) {
-					parent_header = dir_table +
-						sqfs_get_dir_offset(i);
-				}
+		/*
+		 * Redefine inode as the found token: the header's inode table
+		 * block and the entry's offset directly locate its inode.
+		 */
+		i->base = sqfs_read_inode_ref(ctx, ((uint64_t)header->start
+						    << 16) | entry->offset);
+		if (!i->base || i->base->inode_number !=
+		    header->inode_number + entry->inode_offset) {
+			printe("%s: Invalid inode reference.\n", __func__);
+			return -EINVAL;
+		}
+	}
 
-				break;
-			}
+	return 0;
+}
 
-			total_length += ENTRY_BASE_LENGTH + name_length;
-		}
+/*
+ * Find the inode of the absolute 'path', starting from the root inode. 'path'
+ * is modified in the process.
+ */
+int sqfs_resolve_path(struct sqfs_ctx *ctx, char *path,
+		      union squashfs_inode *i)
+{
+	char *token, *saveptr;
+	int ret;
 
-		if (!equals) {
-			printf("Entry not found.\n");
-			return -EINVAL;
-		}
+	i->base = sqfs_read_inode_ref(ctx, ctx->sblk->root_inode);
+	if (!i->base) {
+		printe("Root inode not found.\n");
+		return -EINVAL;
+	}
 
-		total_length = 0;
+	for (token = strtok_r(path, "/", &saveptr); token;
+	     token = strtok_r(NULL, "/", &saveptr)) {
+		ret = sqfs_search_entry(i, &token, 1, ctx);
+		if (ret)
+			return ret;
 	}
 
 	return 0;
 }
 
-static int sqfs_display_entry_content(union squashfs_inode *i, void
-				      *file_mapping, void *dir_table,
-				      void *inode_table, bool is_a_file)
+static int sqfs_display_entry_content(union squashfs_inode *i,
+				      struct sqfs_ctx *ctx, bool is_a_file)
 {
-	int k, l, j = 0, ret = 0, datablk_count = 0;
-	char *fragment_block, **datablocks;
-	bool compressed, frag;
-	uint32_t *frag_block_offset, *block_sizes, compressed_size;
-	struct fragment_block_entry frag_entry;
-	size_t dest_len, file_size;
 	struct squashfs_super_block *sblk;
 	union squashfs_inode parent;
-	unsigned long blocks_start;
-
-	sblk = file_mapping;
+	struct sqfs_file file;
+	struct sqfs_sink sink;
+	int l, ret;
 
-	/* If is root, do not look for parent */
-	if (i->base->inode_number == sblk->inodes) {
-		parent.base = i->base;
-	} else {
-		parent.base = sqfs_find_inode(inode_table,
-					      i->base->inode_number + 1,
-					      sblk->inodes, sblk->block_size);
-	}
+	sblk = ctx->sblk;
 
 	if (is_a_file) {
 		switch (i->base->inode_type) {
@@ -267,27 +167,6 @@ static int sqfs_display_entry_content(union squashfs_inode *i, void
 			       i->reg->offset);
 			printd("(Uncompressed) File size: %u\n",
 			       i->reg->file_size);
-			file_size = i->reg->file_size;
-			frag_block_offset = &i->reg->offset;
-			blocks_start = i->reg->start_block;
-			block_sizes = i->reg->block_list;
-			frag = IS_FRAGMENTED(i->reg->fragment);
-
-			/* Count number of data blocks used to store the file */
-			if (frag) {
-				printd("Fragmented file.\n");
-				datablk_count = (i->reg->file_size
-						 / sblk->block_size);
-
-				compressed = sqfs_frag_lookup(file_mapping,
-							      i->reg->fragment,
-							      &frag_entry);
-			} else {
-				printd("File not fragmented.\n");
-				datablk_count = ceil((float)i->reg->file_size
-						     / sblk->block_size);
-			}
-
 			break;
 		case SQUASHFS_LREG_TYPE:
 			printd("Extended File\n");
@@ -299,26 +178,6 @@ static int sqfs_display_entry_content(union squashfs_inode *i, void
 			       i->lreg->offset);
 			printd("(Uncompressed) File size: %lu\n",
 			       i->lreg->file_size);
-			file_size = i->lreg->file_size;
-			frag_block_offset = &i->lreg->offset;
-			blocks_start = i->lreg->start_block;
-			block_sizes = i->lreg->block_list;
-			frag = IS_FRAGMENTED(i->lreg->fragment);
-
-			if (frag) {
-				printd("Fragmented file.\n");
-				datablk_count = (i->lreg->file_size
-						 / sblk->block_size);
-
-				compressed = sqfs_frag_lookup(file_mapping,
-							      i->lreg->fragment,
-							      &frag_entry);
-			} else {
-				printd("File not fragmented.\n");
-				datablk_count = ceil((float)i->lreg->file_size
-						     / sblk->block_size);
-			}
-
 			break;
 		case SQUASHFS_SYMLINK_TYPE:
 		case SQUASHFS_LSYMLINK_TYPE:
@@ -344,129 +203,61 @@ static int sqfs_display_entry_content(union squashfs_inode *i, void
 			printd("Extended Fifo | Socket\n");
 			break;
 		default:
-			printf("Unknown entry type\n");
+			printe("Unknown entry type\n");
 			return -EINVAL;
 		}
 	/* It's a directory */
 	} else {
-		if (sqfs_is_empty_dir(i)) {
-			sqfs_print_dir_name(i, &parent, inode_table,
-					    dir_table);
+		if (!sqfs_is_dir(i)) {
+			printe("Not a directory.\n");
+			return -EINVAL;
+		}
 
-			printf("Empty directory.\n");
+		/* If is root, do not look for parent */
+		if (i->base->inode_number == sblk->inodes) {
+			parent.base = i->base;
 		} else {
-			sqfs_dump_dir(i, &parent, inode_table, dir_table);
+			parent.base = sqfs_find_inode(ctx,
+						      sqfs_get_parent_inode(i));
+			if (!parent.base)
+				return -EINVAL;
 		}
 
-		return 0;
-	}
-
-	printd("Display file content:\n\n");
-	if (datablk_count > 0) {
-		printd("Number of data blocks %d\n", datablk_count);
-		datablocks = malloc(datablk_count * sizeof(char *));
-		if (!datablocks) {
-			printf("%s: Memory allocation error.\n", __func__);
-			free(datablocks);
-			return errno;
-		}
+		if (sqfs_is_empty_dir(i)) {
+			sqfs_print_dir_name(i, &parent, &ctx->dir_table);
 
-		for (j = 0; j < datablk_count; j++) {
-			datablocks[j] = malloc(sblk->block_size);
-			if (!datablocks[j]) {
-				printf("%s: Memory allocation error.\n",
-				       __func__);
-				free(datablocks[j]);
-				ret = errno;
-				goto free_memory;
-			}
+			printf("Empty directory.\n");
+		} else {
+			return sqfs_dump_dir(i, &parent, &ctx->dir_table);
 		}
 
-	} else {
-		printd("Completely fragmented file (no data blocks)\n");
-	}
-
-	if (sblk->flags & SQUASHFS_UNCOMPRESSED_DATA) {
-		printd("Data blocks are uncompressed.\n");
-		datablocks = file_mapping + blocks_start;
-		for (j = 0; j < datablk_count; j++)
-			for (k = 0; k < sblk->block_size; k++)
-				printf("%c", datablocks[j][k]);
-	} else {
-		printd("Data blocks are compressed.\n");
-		compressed_size = 0;
-		for (j = 0; j < datablk_count; j++) {
-			dest_len = sblk->block_size;
-			ret = sqfs_decompress(datablocks[j], &dest_len,
-					      file_mapping + blocks_start +
-					      compressed_size,
-					      block_sizes[j]);
-			if (ret != Z_OK) {
-				printf("Error while decompressing data blk.\n");
-				return ret;
-			}
-
-			compressed_size += block_sizes[j];
-		}
+		return 0;
 	}
 
-	/* Display data block(s) content */
-	for (j = 0; j < datablk_count; j++)
-		for (k = 0; k < sblk->block_size; k++) {
-			printf("%c", datablocks[j][k]);
-			file_size--;
-		}
-
-	/* File compressed and fragmented */
-	if (frag && compressed) {
-		dest_len = sblk->block_size;
-		fragment_block = malloc(sblk->block_size);
-		if (!fragment_block) {
-			printf("%s: Memory allocation error.\n", __func__);
-			free(fragment_block);
-			ret = errno;
-			goto free_memory;
-		}
-
-		ret = sqfs_decompress(fragment_block, &dest_len, file_mapping +
-				      frag_entry.start, frag_entry.size);
-		if (ret != Z_OK) {
-			printf("Error while decompressing fragment block.\n");
-			goto free_memory;
-		}
-
-		printd("Uncompressed fragment block size: %ld\n", dest_len);
-		for (j = 0; j < file_size; j++)
-			printf("%c", fragment_block[*frag_block_offset + j]);
-
-		free(fragment_block);
-	} else if (frag && !compressed) {
-		fragment_block = file_mapping + frag_entry.start;
-		for (j = 0; j < file_size; j++)
-			printf("%c", fragment_block[*frag_block_offset + j]);
-	}
+	/* Only regular files have content to display */
+	if (i->base->inode_type != SQUASHFS_REG_TYPE &&
+	    i->base->inode_type != SQUASHFS_LREG_TYPE)
+		return 0;
 
-free_memory:
+	ret = sqfs_file_init(ctx, i, &file);
+	if (ret)
+		return ret;
 
-	for (j = 0; j < datablk_count; j++)
-		free(datablocks[j]);
-	if (datablk_count > 0)
-		free(datablocks);
+	printd("Display file content:\n\n");
+	sqfs_sink_init(&sink, STDOUT_FILENO, file.file_size);
 
-	return ret;
+	return sqfs_write_file(ctx, &file, &sink);
 }
 
 /* Given a path to a file or directory, return its content */
-int sqfs_dump_entry(void *file_mapping, char *path)
+int sqfs_dump_entry(struct sqfs_image *img, char *path, int threads)
 {
 	int j = 0, token_count = 0, ret = 0;
-	char *dest_inode_table, *dest_dir_table;
 	char **token_list, *aux;
-	bool compressed, is_a_file, is_a_dir;
-	void *dir_table, *inode_table;
-	size_t src_len, dest_len;
+	bool is_a_file, is_a_dir;
 	struct squashfs_super_block *sblk;
 	union squashfs_inode i;
+	struct sqfs_ctx ctx;
 
 	/* Parsing path to file/directory */
 	token_count = sqfs_parse_path(path, &is_a_dir);
@@ -474,294 +265,378 @@ int sqfs_dump_entry(void *file_mapping, char *path)
 		return -EINVAL;
 	is_a_file = !is_a_dir;
 
-	/* Tokenize path string */
-	token_list = malloc(token_count * sizeof(char *));
-	if (!token_list) {
-		printf("%s: Memory allocation error.\n", __func__);
-		free(token_list);
-		return errno;
-	}
+	sblk = (void *)img->head;
 
-	if (path[0] == '/' && strlen(path) == 1) {
-		token_list[0] = malloc(strlen(path) + 1);
-		strcpy(token_list[0], path);
-	} else {
-		for (j = 0; j < token_count; j++) {
-			aux = strtok(!j ? path : NULL, "/");
-			token_list[j] = malloc(strlen(aux) + 1);
-			if (!token_list[j]) {
-				printf("%s: Memory allocation error.\n",
-				       __func__);
-				free(token_list[j]);
-				return errno;
-			}
-
-			strcpy(token_list[j], aux);
-		}
-	}
+	/* Index the inode and directory tables' metadata blocks */
+	ret = sqfs_ctx_init(&ctx, img);
+	if (ret)
+		return ret;
 
-	sblk = file_mapping;
+	ctx.threads = threads;
 
-	/* Parse inode table (metadata block) header */
-	ret = sqfs_read_metablock(file_mapping, sblk->inode_table_start,
-				  &compressed, &src_len);
-	if (ret) {
-		printf("Null pointers passed to sqfs_read_metablock.\n");
-		goto free_memory;
+	/*
+	 * Tokenize path string: the tokens point into 'path', which is split
+	 * in place, only their list is allocated
+	 */
+	token_list = sqfs_arena_alloc(&ctx.arena, token_count * sizeof(char *));
+	if (!token_list) {
+		ret = -ENOMEM;
+		goto free_ctx;
 	}
 
-	inode_table = file_mapping + sblk->inode_table_start + HEADER_SIZE;
-
-	/* Extract compressed Inode table */
-	if (compressed) {
-		dest_len = METADATA_BLOCK_SIZE;
-		dest_inode_table = malloc(dest_len);
-		if (!dest_inode_table) {
-			printf("%s: Memory allocation error.\n", __func__);
-			free(dest_inode_table);
-			return errno;
-		}
-
-		ret = sqfs_decompress(dest_inode_table, &dest_len, inode_table,
-				      src_len);
-		if (ret != Z_OK)
-			return ret;
-
-		printd("Uncompressed table size: %lu bytes\n", dest_len);
-		inode_table = dest_inode_table;
-	}
+	for (j = 0; j < token_count; j++) {
+		aux = strtok(!j ? path : NULL, "/");
+		if (!aux)
+			break;
 
-	/* Parse directory table (metadata block) header */
-	ret = sqfs_read_metablock(file_mapping, sblk->directory_table_start,
-				  &compressed, &src_len);
-	if (ret) {
-		printf("Null pointers passed to sqfs_read_metablock.\n");
-		goto free_memory;
+		token_list[j] = aux;
 	}
 
-	dir_table = file_mapping + sblk->directory_table_start + HEADER_SIZE;
-
-	/* Extract compressed Directory table */
-	if (compressed) {
-		dest_len = METADATA_BLOCK_SIZE;
-		dest_dir_table = malloc(dest_len);
-		if (!dest_dir_table) {
-			printf("%s: Memory allocation error.\n", __func__);
-			free(dest_dir_table);
-			return errno;
-		}
-
-		ret = sqfs_decompress(dest_dir_table, &dest_len, dir_table,
-				      src_len);
-		if (ret != Z_OK) {
-			printf("%s: Error while uncompressing metadata.\n",
-			       __func__);
-			return ret;
-		}
-
-		printd("Uncompressed table size: %lu bytes\n", dest_len);
-		dir_table = dest_dir_table;
-	}
+	/* Empty components ("//") are skipped */
+	token_count = j;
 
 	/*
 	 * Look for file or directory name in Directory table, starting by root
 	 * inode
 	 */
-	i.base = sqfs_find_inode(inode_table, sblk->inodes, sblk->inodes,
-				 sblk->block_size);
+	i.base = sqfs_read_inode_ref(&ctx, sblk->root_inode);
+	if (!i.base) {
+		printe("Root inode not found.\n");
+		ret = -EINVAL;
+		goto free_ctx;
+	}
 
 	/* If the path is equal to '/', display root content */
 	if (!strcmp(path, "/"))
 		goto dump_entry;
 
-	ret = sqfs_search_entry(&i, token_list, token_count, inode_table,
-				dir_table, sblk->inodes, sblk->block_size);
+	ret = sqfs_search_entry(&i, token_list, token_count, &ctx);
 
 	if (ret) {
-		printf("Error while searching for entry\n");
-		goto free_memory;
+		printe("Error while searching for entry\n");
+		goto free_ctx;
 	}
 
 dump_entry:
 
-	ret = sqfs_display_entry_content(&i, file_mapping, dir_table,
-					 inode_table, is_a_file);
+	ret = sqfs_display_entry_content(&i, &ctx, is_a_file);
 	if (ret)
-		printf("Error while displaying entry content.\n");
-
-free_memory:
+		printe("Error while displaying entry content.\n");
 
-	for (j = 0; j < token_count; j++)
-		free(token_list[j]);
-	free(token_list);
+free_ctx:
 
-	free(dest_dir_table);
-	free(dest_inode_table);
+	sqfs_ctx_free(&ctx);
 
 	return ret;
 }
 
 /*
- * Given the uncompressed inode table, the inode to be found and the number of
- * inodes in the table, return inode position in case of success.
+ * Return the inode stored at the uncompressed position 'pos' of the inode
+ * table, once all of its bytes (block list, directory index or symlink target
+ * included) are available, and store its total length in *size.
  */
-void *sqfs_find_inode(void *inode_table, int inode_number, int inode_count,
-		      uint32_t block_size)
+void *sqfs_read_inode(struct sqfs_meta_table *inode_table, uint64_t pos,
+		      uint32_t block_size, size_t *size)
 {
-	int k, l, block_list_size = 0, offset = 0, index_list_size = 0;
+	struct squashfs_dir_index *index;
 	union squashfs_inode i;
+	size_t length;
+	int l;
+
+	i.base = sqfs_meta_table_at(inode_table, pos, sizeof(*i.base));
+	if (!i.base)
+		return NULL;
+
+	switch (i.base->inode_type) {
+	case SQUASHFS_DIR_TYPE:
+		length = sizeof(struct squashfs_dir_inode);
+		break;
+	case SQUASHFS_REG_TYPE:
+		i.reg = sqfs_meta_table_at(inode_table, pos, sizeof(*i.reg));
+		if (!i.reg)
+			return NULL;
+
+		length = sizeof(*i.reg) +
+			sqfs_count_blocks(i.reg->file_size, i.reg->fragment,
+					  block_size) * sizeof(uint32_t);
+		break;
+	case SQUASHFS_LDIR_TYPE:
+		i.ldir = sqfs_meta_table_at(inode_table, pos, sizeof(*i.ldir));
+		if (!i.ldir)
+			return NULL;
+
+		/*
+		 * 'i_count' directory indexes follow the inode, each one
+		 * ending by a name of 'size' + 1 bytes.
+		 */
+		length = sizeof(*i.ldir);
+		for (l = 0; l < i.ldir->i_count; l++) {
+			index = sqfs_meta_table_at(inode_table, pos + length,
+						   DIR_INDEX_BASE_LENGTH);
+			if (!index)
+				return NULL;
+
+			length += DIR_INDEX_BASE_LENGTH + index->size + 1;
+		}
+
+		break;
+	case SQUASHFS_LREG_TYPE:
+		i.lreg = sqfs_meta_table_at(inode_table, pos, sizeof(*i.lreg));
+		if (!i.lreg)
+			return NULL;
+
+		length = sizeof(*i.lreg) +
+			sqfs_count_blocks(i.lreg->file_size, i.lreg->fragment,
+					  block_size) * sizeof(uint32_t);
+		break;
+	case SQUASHFS_SYMLINK_TYPE:
+	case SQUASHFS_LSYMLINK_TYPE:
+		i.symlink = sqfs_meta_table_at(inode_table, pos,
+					       sizeof(*i.symlink));
+		if (!i.symlink)
+			return NULL;
 
-	if (!inode_table) {
-		printf("%s: Invalid pointer to inode table.\n", __func__);
+		length = sizeof(*i.symlink) + i.symlink->symlink_size;
+
+		/* Extended symlinks end by an xattr index */
+		if (i.base->inode_type == SQUASHFS_LSYMLINK_TYPE)
+			length += sizeof(__le32);
+		break;
+	case SQUASHFS_BLKDEV_TYPE:
+	case SQUASHFS_CHRDEV_TYPE:
+		length = sizeof(struct squashfs_dev_inode);
+		break;
+	case SQUASHFS_LBLKDEV_TYPE:
+	case SQUASHFS_LCHRDEV_TYPE:
+		length = sizeof(struct squashfs_ldev_inode);
+		break;
+	case SQUASHFS_FIFO_TYPE:
+	case SQUASHFS_SOCKET_TYPE:
+		length = sizeof(struct squashfs_ipc_inode);
+		break;
+	case SQUASHFS_LFIFO_TYPE:
+	case SQUASHFS_LSOCKET_TYPE:
+		length = sizeof(struct squashfs_lipc_inode);
+		break;
+	default:
+		printe("Error while reading inode: unknown type.\n");
 		return NULL;
 	}
 
-	for (k = 0; k < inode_count; k++) {
-		i.base = inode_table + offset;
-		if (i.base->inode_number == inode_number)
-			return (void *)(inode_table + offset);
+	*size = length;
 
-		switch (i.base->inode_type) {
-		case SQUASHFS_DIR_TYPE:
-			i.dir = inode_table + offset;
-			offset += sizeof(struct squashfs_dir_inode);
-			break;
-		case SQUASHFS_REG_TYPE:
-			i.reg = inode_table + offset;
-
-			if (IS_FRAGMENTED(i.reg->fragment)) {
-				block_list_size = (i.reg->file_size /
-						    block_size);
-			} else {
-				block_list_size = ceil((float)i.reg->file_size
-						       / block_size);
-			}
-
-			offset += sizeof(struct squashfs_reg_inode) +
-				block_list_size * sizeof(uint32_t);
-			break;
-		case SQUASHFS_LDIR_TYPE:
-			i.ldir = inode_table + offset;
-			if (i.ldir->i_count == 0) {
-				offset += sizeof(struct squashfs_ldir_inode);
-				break;
-			}
+	return sqfs_meta_table_at(inode_table, pos, length);
+}
 
-			for (l = 0; l < i.ldir->i_count + 1; l++)
-				index_list_size += i.ldir->index[l].size + 1;
+/*
+ * Walk the whole inode table once and record where each inode number lives,
+ * so that later lookups by number do not need to rescan the table.
+ */
+int sqfs_build_inode_index(struct sqfs_ctx *ctx)
+{
+	struct sqfs_inode_index *index = &ctx->inode_index;
+	struct squashfs_super_block *sblk = ctx->sblk;
+	struct sqfs_inode_loc *loc;
+	union squashfs_inode i;
+	uint64_t pos = 0;
+	size_t size;
+	uint32_t k;
 
-			offset += sizeof(struct squashfs_ldir_inode)
-				+ (i.ldir->i_count + 1) * DIR_INDEX_BASE_LENGTH
-				+ index_list_size;
+	index->locs = sqfs_arena_zalloc(&ctx->arena, (size_t)sblk->inodes *
+					sizeof(*index->locs));
+	if (!index->locs)
+		return -ENOMEM;
 
-			index_list_size = 0;
-			break;
-		case SQUASHFS_LREG_TYPE:
-			i.lreg = inode_table + offset;
-			if (i.lreg->fragment == 0xFFFFFFFF) {
-				block_list_size = ceil((float)i.lreg->file_size
-						       / block_size);
-			} else {
-				block_list_size = (i.lreg->file_size /
-						    block_size);
-			}
-
-			offset += sizeof(struct squashfs_lreg_inode)
-				+ block_list_size * sizeof(uint32_t);
+	index->count = sblk->inodes;
+	for (k = 0; k < sblk->inodes; k++) {
+		i.base = sqfs_read_inode(&ctx->inode_table, pos,
+					 sblk->block_size, &size);
+		if (!i.base)
+			goto corrupted;
+
+		if (!i.base->inode_number ||
+		    i.base->inode_number > sblk->inodes)
+			goto corrupted;
+
+		loc = &index->locs[i.base->inode_number - 1];
+		loc->block = pos / METADATA_BLOCK_SIZE;
+		loc->offset = pos % METADATA_BLOCK_SIZE;
+		loc->type = i.base->inode_type;
+		pos += size;
+	}
 
-			break;
-		case SQUASHFS_SYMLINK_TYPE:
-		case SQUASHFS_LSYMLINK_TYPE:
-			i.symlink = inode_table + offset;
-			offset += sizeof(struct squashfs_symlink_inode)
-				+ i.symlink->symlink_size;
+	printd("Inode index built: %u inodes\n", index->count);
 
-			break;
-		case SQUASHFS_BLKDEV_TYPE:
-		case SQUASHFS_CHRDEV_TYPE:
-			i.dev = inode_table + offset;
-			offset += sizeof(struct squashfs_dev_inode);
-			break;
-		case SQUASHFS_LBLKDEV_TYPE:
-		case SQUASHFS_LCHRDEV_TYPE:
-			i.ldev = inode_table + offset;
-			offset += sizeof(struct squashfs_ldev_inode);
-			break;
-		case SQUASHFS_FIFO_TYPE:
-		case SQUASHFS_SOCKET_TYPE:
-			i.ipc = inode_table + offset;
-			offset += sizeof(struct squashfs_ipc_inode);
-			break;
-		case SQUASHFS_LFIFO_TYPE:
-		case SQUASHFS_LSOCKET_TYPE:
-			i.lipc = inode_table + offset;
-			offset += sizeof(struct squashfs_lipc_inode);
-			break;
-		default:
-			printf("Error while searching inode: unknown type.\n");
-			return NULL;
-		}
+	return 0;
+
+corrupted:
+	printe("%s: Corrupted inode table.\n", __func__);
+	index->locs = NULL;
+	index->count = 0;
+
+	return -EINVAL;
+}
+
+/*
+ * Exportable images carry a table mapping each inode number to its inode
+ * reference: entry n - 1 describes inode n. The table index, at
+ * 'lookup_table_start', points to the metadata blocks holding the entries.
+ */
+int sqfs_export_lookup(struct sqfs_ctx *ctx, uint32_t inode_number,
+		       uint64_t *ref)
+{
+	struct squashfs_super_block *sblk = ctx->sblk;
+	uint64_t start_block, *entries;
+	uint32_t block, offset;
+	size_t size;
+	int ret;
+
+	if (!ctx->sblkf.exportable ||
+	    sblk->lookup_table_start == SQUASHFS_INVALID_BLK)
+		return -EOPNOTSUPP;
+
+	if (!inode_number || inode_number > sblk->inodes)
+		return -EINVAL;
+
+	block = (inode_number - 1) / SQUASHFS_LOOKUP_ENTRIES;
+	offset = (inode_number - 1) % SQUASHFS_LOOKUP_ENTRIES;
+	ret = sqfs_image_read(ctx->image, &start_block, sizeof(start_block),
+			      sblk->lookup_table_start +
+			      block * sizeof(start_block));
+	if (ret)
+		return ret;
+
+	entries = sqfs_meta_cache_get(&ctx->meta_cache, start_block, &size);
+	if (!entries || (offset + 1) * sizeof(*entries) > size)
+		return -EINVAL;
+
+	*ref = entries[offset];
+	printd("Inode %u: reference 0x%lx\n", inode_number, *ref);
+
+	return 0;
+}
+
+/*
+ * Inodes store their uid and gid as indexes in the id table, whose index, at
+ * 'id_table_start', points to the metadata blocks holding the 32-bit ids.
+ */
+int sqfs_id_lookup(struct sqfs_ctx *ctx, uint16_t index, uint32_t *id)
+{
+	struct squashfs_super_block *sblk = ctx->sblk;
+	uint64_t start_block;
+	uint32_t block, offset, *ids;
+	size_t size;
+	int ret;
+
+	if (index >= sblk->no_ids)
+		return -EINVAL;
+
+	block = index / SQUASHFS_ID_ENTRIES;
+	offset = index % SQUASHFS_ID_ENTRIES;
+	ret = sqfs_image_read(ctx->image, &start_block, sizeof(start_block),
+			      sblk->id_table_start +
+			      block * sizeof(start_block));
+	if (ret)
+		return ret;
+
+	ids = sqfs_meta_cache_get(&ctx->meta_cache, start_block, &size);
+	if (!ids || (offset + 1) * sizeof(*ids) > size)
+		return -EINVAL;
+
+	*id = ids[offset];
+
+	return 0;
+}
+
+/* Decode the device number of a (basic or extended) device inode */
+dev_t sqfs_rdev(uint32_t rdev)
+{
+	return makedev((rdev & 0xfff00) >> 8,
+		       (rdev & 0xff) | ((rdev >> 12) & 0xfff00));
+}
+
+/* Return the inode pointed to by an inode reference */
+void *sqfs_read_inode_ref(struct sqfs_ctx *ctx, uint64_t ref)
+{
+	int64_t pos;
+	size_t size;
+
+	pos = sqfs_meta_table_pos(&ctx->inode_table, SQUASHFS_INODE_BLK(ref),
+				  SQUASHFS_INODE_OFFSET(ref));
+	if (pos < 0)
+		return NULL;
+
+	return sqfs_read_inode(&ctx->inode_table, pos, ctx->sblk->block_size,
+			       &size);
+}
+
+/*
+ * Given an inode number, return the inode in case of success. The export
+ * table is used when available, otherwise the inode table gets indexed on the
+ * first call.
+ */
+void *sqfs_find_inode(struct sqfs_ctx *ctx, uint32_t inode_number)
+{
+	struct squashfs_base_inode *base;
+	struct sqfs_inode_loc *loc;
+	uint64_t ref;
+	size_t size;
+
+	if (!ctx->inode_index.locs &&
+	    !sqfs_export_lookup(ctx, inode_number, &ref)) {
+		base = sqfs_read_inode_ref(ctx, ref);
+		if (base && base->inode_number == inode_number)
+			return base;
+
+		printd("Invalid export table entry, indexing inodes\n");
 	}
 
-	return NULL;
+	if (!ctx->inode_index.locs && sqfs_build_inode_index(ctx))
+		return NULL;
+
+	if (!inode_number || inode_number > ctx->inode_index.count)
+		return NULL;
+
+	loc = &ctx->inode_index.locs[inode_number - 1];
+	if (!loc->type)
+		return NULL;
+
+	return sqfs_read_inode(&ctx->inode_table,
+			       (uint64_t)loc->block * METADATA_BLOCK_SIZE +
+			       loc->offset, ctx->sblk->block_size, &size);
 }
 
-int sqfs_dump_inode_table(void *file_mapping)
+int sqfs_dump_inode_table(struct sqfs_image *img)
 {
-	int k, l, ret, inode_sizes = 0, block_list_size = 1,
-	    index_list_size = 0;
+	int k, l, ret, block_list_size = 1;
 	struct squashfs_super_block *sblk;
-	unsigned char *dest_table;
-	unsigned long dest_len;
 	union squashfs_inode i;
 	char modified_time[80];
 	struct tm timestamp;
-	void *inode_table;
-	size_t data_size;
+	uint64_t inode_sizes = 0;
+	struct sqfs_ctx ctx;
 	time_t rawtime;
-	bool compressed;
+	size_t size;
 
-	sblk = file_mapping;
+	sblk = (void *)img->head;
 	printd("Inode table size: %ld bytes\n",
 	       sblk->directory_table_start - sblk->inode_table_start);
 
-	ret = sqfs_read_metablock(file_mapping, sblk->inode_table_start,
-				  &compressed, &data_size);
-	if (ret) {
-		printf("Null pointers passed to sqfs_read_metablock.\n");
+	ret = sqfs_ctx_init(&ctx, img);
+	if (ret)
 		return ret;
-	}
-
-	inode_table = file_mapping + sblk->inode_table_start + HEADER_SIZE;
-
-	if (compressed) {
-		/*
-		 * The largest inode is squashfs_lreg_inode, with a minimal size
-		 * of 56 bytes, supposing an empty 'block_list' member.
-		 */
-		dest_len = sblk->inodes * LREG_INODE_MIN_SIZE;
-		dest_table = malloc(dest_len);
-		if (!dest_table) {
-			printf("%s: Memory allocation error.\n", __func__);
-			free(dest_table);
-			return errno;
-		}
-
-		ret = sqfs_decompress(dest_table, &dest_len, inode_table,
-				      data_size);
-		if (ret != Z_OK) {
-			printf("Error while uncompressing metadata.\n");
-			return ret;
-		}
-
-		printd("Uncompressed table size: %lu bytes\n", dest_len);
-		inode_table = dest_table;
-	}
 
 	printf("--- --- ---\n");
 	for (k = 0; k < sblk->inodes; k++) {
 		printf("{Inode %d/%d}\n", k + 1, sblk->inodes);
-		i.base = inode_table + inode_sizes;
+		i.base = sqfs_read_inode(&ctx.inode_table, inode_sizes,
+					 sblk->block_size, &size);
+		if (!i.base) {
+			printe("Error while reading inode.\n");
+			ret = -EINVAL;
+			goto free_ctx;
+		}
+
 		printf("--- --- ---\n");
 
 		/* Display inode header, type-independent */
@@ -782,7 +657,6 @@ int sqfs_dump_inode_table(void *file_mapping)
 		switch (i.base->inode_type) {
 		case SQUASHFS_DIR_TYPE:
 			printf("Basic Directory\n");
-			i.dir = inode_table + inode_sizes;
 
 			/*
 			 * The index of the block in the Directory Table where
@@ -809,11 +683,9 @@ int sqfs_dump_inode_table(void *file_mapping)
 			/* The inode number of the parent of this directory */
 			printf("Parent inode number: %u\n",
 			       i.dir->parent_inode);
-			inode_sizes += sizeof(struct squashfs_dir_inode);
 			break;
 		case SQUASHFS_REG_TYPE:
 			printf("Basic File\n");
-			i.reg = inode_table + inode_sizes;
 
 			/*
 			 * The offset from the start of the archive where the
@@ -839,21 +711,13 @@ int sqfs_dump_inode_table(void *file_mapping)
 			printf("(Uncompressed) File size: %u\n",
 			       i.reg->file_size);
 
-			if (IS_FRAGMENTED(i.reg->fragment))
-				block_list_size = (i.reg->file_size /
-						    sblk->block_size);
-			else
-				block_list_size =  ceil((float)i.reg->file_size
-							/ sblk->block_size);
-
+			block_list_size = sqfs_count_blocks(i.reg->file_size,
+							    i.reg->fragment,
+							    sblk->block_size);
 			printd("Block list size %d\n", block_list_size);
-			inode_sizes += sizeof(struct squashfs_reg_inode) +
-				block_list_size * sizeof(uint32_t);
-
 			break;
 		case SQUASHFS_LDIR_TYPE:
 			printf("Extended Directory\n");
-			i.ldir = inode_table + inode_sizes;
 			printf("Start block: 0x%08x\n", i.ldir->start_block);
 			printf("Hard links: %u\n", i.ldir->nlink);
 			printf("File size: %u\n", i.ldir->file_size);
@@ -862,8 +726,8 @@ int sqfs_dump_inode_table(void *file_mapping)
 			       i.ldir->parent_inode);
 
 			/*
-			 * One less than the number of directory index entries
-			 * following the inode structure
+			 * The number of directory index entries following the
+			 * inode structure
 			 */
 			printf("Index count: %u\n", i.ldir->i_count);
 
@@ -872,27 +736,9 @@ int sqfs_dump_inode_table(void *file_mapping)
 			 * 0xFFFFFFFF if the inode has no extended attributes
 			 */
 			printf("Xattr table index: 0x%08x\n", i.ldir->xattr);
-
-			/*
-			 * Iterate through all directory indexes in the list
-			 * and accumulate all its 'name' member sizes
-			 */
-			if (i.ldir->i_count == 0) {
-				inode_sizes +=
-					sizeof(struct squashfs_ldir_inode);
-				break;
-			}
-			for (l = 0; l < i.ldir->i_count + 1; l++)
-				index_list_size += i.ldir->index[l].size + 1;
-			inode_sizes += sizeof(struct squashfs_ldir_inode)
-				+ (i.ldir->i_count + 1) * DIR_INDEX_BASE_LENGTH
-				+ index_list_size;
-
-			index_list_size = 0;
 			break;
 		case SQUASHFS_LREG_TYPE:
 			printf("Extended File\n");
-			i.lreg = inode_table + inode_sizes;
 			printf("Start block: 0x%lx\n", i.lreg->start_block);
 			printf("Fragment block index: 0x%08x\n",
 			       i.lreg->fragment);
@@ -908,21 +754,10 @@ int sqfs_dump_inode_table(void *file_mapping)
 			printf("Sparse (?): %lu\n", i.lreg->sparse);
 			printf("Hard links: %u\n", i.lreg->nlink);
 			printf("Xattr table index: 0x%x\n", i.lreg->xattr);
-			if (IS_FRAGMENTED(i.lreg->fragment))
-				block_list_size = (i.lreg->file_size /
-						    sblk->block_size);
-			else
-				block_list_size = ceil(i.lreg->file_size /
-						    (float)sblk->block_size);
-
-			inode_sizes += sizeof(struct squashfs_lreg_inode)
-				+ block_list_size * sizeof(uint32_t);
-
 			break;
 		case SQUASHFS_SYMLINK_TYPE:
 		case SQUASHFS_LSYMLINK_TYPE:
 			printf("Basic Symlink\n");
-			i.symlink = inode_table + inode_sizes;
 			printf("Hard links: %u\n", i.symlink->nlink);
 
 			/*
@@ -947,14 +782,13 @@ int sqfs_dump_inode_table(void *file_mapping)
 			 * attributes
 			 */
 			if (i.base->inode_type == SQUASHFS_LSYMLINK_TYPE)
-				printf("Xattr index: 0x%08x\n", i.ldev->xattr);
-			inode_sizes += sizeof(struct squashfs_symlink_inode)
-				+ i.symlink->symlink_size;
+				printf("Xattr index: 0x%08x\n",
+				       *(__le32 *)(i.symlink->symlink +
+						   i.symlink->symlink_size));
 			break;
 		case SQUASHFS_BLKDEV_TYPE:
 		case SQUASHFS_CHRDEV_TYPE:
 			printf("Basic Block | Char. device\n");
-			i.dev = inode_table + inode_sizes;
 			printf("Hard links: %u\n", i.dev->nlink);
 
 			/* rdev encodes the major and minor numbers */
@@ -962,67 +796,42 @@ int sqfs_dump_inode_table(void *file_mapping)
 			       (i.dev->rdev >> 8) & MAJOR_NUMBER_BITMASK,
 			       (i.dev->rdev & MINOR_NUMBER_BITMASK)
 			       | ((i.dev->rdev >> 12) & MAJOR_NUMBER_BITMASK));
-			inode_sizes += sizeof(struct squashfs_dev_inode);
 			break;
 		case SQUASHFS_LBLKDEV_TYPE:
 		case SQUASHFS_LCHRDEV_TYPE:
 			printf("Extended Block | Char. device\n");
-			i.ldev = inode_table + inode_sizes;
 			printf("Hard links: %u\n", i.ldev->nlink);
 			printf("Major/Minor device numbers: %ld/%ld\n",
 			       (i.dev->rdev >> 8) & MAJOR_NUMBER_BITMASK,
 			       (i.ldev->rdev & MINOR_NUMBER_BITMASK)
 			       | ((i.ldev->rdev >> 12) & MAJOR_NUMBER_BITMASK));
 			printf("Xattr index: 0x%08x\n", i.ldev->xattr);
-			inode_sizes += sizeof(struct squashfs_ldev_inode);
 			break;
 		case SQUASHFS_FIFO_TYPE:
 		case SQUASHFS_SOCKET_TYPE:
-			i.ipc = inode_table + inode_sizes;
 			printf("Basic Fifo | Socket\n");
 			printf("Hard links: %u\n", i.ipc->nlink);
-			inode_sizes += sizeof(struct squashfs_ipc_inode);
 			break;
 		case SQUASHFS_LFIFO_TYPE:
 		case SQUASHFS_LSOCKET_TYPE:
-			i.lipc = inode_table + inode_sizes;
 			printf("Extended Fifo | Socket\n");
 			printf("Hard links: %u\n", i.lipc->nlink);
 			printf("Xattr index: 0x%08x\n", i.lipc->xattr);
-			inode_sizes += sizeof(struct squashfs_lipc_inode);
 			break;
 		default:
 			printf("Unknown inode type\n");
-			return -EINVAL;
+			ret = -EINVAL;
+			goto free_ctx;
 		}
 
-		printf("inode sizes: %d\n", inode_sizes);
+		inode_sizes += size;
+		printf("inode sizes: %lu\n", inode_sizes);
 		printf("\n\n");
 	}
 
-	free(dest_table);
+free_ctx:
 
-	return 0;
-}
+	sqfs_ctx_free(&ctx);
 
-int sqfs_read_metablock(void *file_mapping, int offset, bool *compressed,
-			size_t *data_size)
-{
-	uint16_t *header;
-
-	if (!compressed || !data_size)
-		return -EINVAL;
-
-	header = file_mapping + offset;
-	printd("Metadata block header: 0x%04x\n", *header);
-	*compressed = IS_COMPRESSED(*header);
-	*data_size = DATA_SIZE(*header);
-	printd("Data size: %ld bytes\n", *data_size);
-
-	if (*compressed)
-		printd("Compressed metadata block\n");
-	else
-		printd("Uncompressed metadata block\n");
-
-	return 0;
+	return ret;
 }
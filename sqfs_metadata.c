@@ -0,0 +1,553 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Bootlin
+ *
+ * Author: Joao Marcos Costa <joaomarcos.costa@bootlin.com>
+ *
+ * sqfs_metadata.c: read the chains of metadata blocks holding the inode and
+ *		    directory tables
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sqfs_filesystem.h"
+#include "sqfs_utils.h"
+#include "sqfs_decompressor.h"
+
+int sqfs_read_metablock(struct sqfs_image *img, uint64_t offset,
+			bool *compressed, size_t *data_size)
+{
+	uint16_t header;
+	int ret;
+
+	if (!compressed || !data_size)
+		return -EINVAL;
+
+	ret = sqfs_image_read(img, &header, sizeof(header), offset);
+	if (ret)
+		return ret;
+
+	printd("Metadata block header: 0x%04x\n", header);
+	*compressed = IS_COMPRESSED(header);
+	*data_size = DATA_SIZE(header);
+	printd("Data size: %ld bytes\n", *data_size);
+
+	if (*compressed)
+		printd("Compressed metadata block\n");
+	else
+		printd("Uncompressed metadata block\n");
+
+	return 0;
+}
+
+/*
+ * Walk the 2-byte headers of the metadata blocks stored between 'start' and
+ * 'end' and record their positions. Nothing is decompressed at this point.
+ * The table's memory comes from 'arena': the array of positions is copied to
+ * a larger one whenever it is full, the former one being left to the arena.
+ */
+int sqfs_meta_table_init(struct sqfs_meta_table *table,
+			 struct sqfs_image *img, struct sqfs_decomp *decomp,
+			 struct sqfs_arena *arena, uint64_t start,
+			 uint64_t end)
+{
+	uint32_t *offsets;
+	uint64_t offset;
+	size_t data_size;
+	bool compressed;
+	int capacity = 0;
+	int ret;
+
+	memset(table, 0, sizeof(*table));
+	table->image = img;
+	table->decomp = decomp;
+	table->start = start;
+
+	for (offset = start; offset < end; table->block_count++) {
+		ret = sqfs_read_metablock(img, offset, &compressed,
+					  &data_size);
+		if (ret)
+			return ret;
+
+		if (table->block_count == capacity) {
+			capacity = capacity ? 2 * capacity : 16;
+			offsets = sqfs_arena_alloc(arena, capacity *
+						   sizeof(uint32_t));
+			if (!offsets)
+				return -ENOMEM;
+
+			if (table->block_count)
+				memcpy(offsets, table->block_offsets,
+				       table->block_count * sizeof(uint32_t));
+			table->block_offsets = offsets;
+		}
+
+		table->block_offsets[table->block_count] = offset - start;
+		offset += HEADER_SIZE + data_size;
+	}
+
+	if (offset != end) {
+		printe("%s: Corrupted metadata table.\n", __func__);
+		return -EINVAL;
+	}
+
+	if (!table->block_count)
+		return 0;
+
+	table->loaded = sqfs_arena_zalloc(arena, table->block_count *
+					  sizeof(bool));
+	table->data = sqfs_arena_alloc(arena, (size_t)table->block_count *
+				       METADATA_BLOCK_SIZE);
+	if (!table->loaded || !table->data)
+		return -ENOMEM;
+
+	table->size = table->block_count * METADATA_BLOCK_SIZE;
+	printd("Metadata table at 0x%lx: %d blocks\n", start,
+	       table->block_count);
+
+	return 0;
+}
+
+/* Decompress the k-th block of the table at its place in 'data' */
+static int sqfs_meta_table_load(struct sqfs_meta_table *table, int k)
+{
+	size_t src_len, dest_len = METADATA_BLOCK_SIZE;
+	const void *src;
+	unsigned char *dest;
+	uint64_t offset;
+	bool compressed;
+	int ret;
+
+	offset = table->start + table->block_offsets[k];
+	dest = table->data + (size_t)k * METADATA_BLOCK_SIZE;
+
+	ret = sqfs_read_metablock(table->image, offset, &compressed,
+				  &src_len);
+	if (ret)
+		return ret;
+
+	if (compressed) {
+		src = sqfs_image_view(table->image, offset + HEADER_SIZE,
+				      src_len);
+		if (!src)
+			return -EIO;
+
+		ret = sqfs_decompress(table->decomp, dest, &dest_len, src,
+				      src_len);
+		if (ret) {
+			printe("%s: Error while uncompressing metadata.\n",
+			       __func__);
+			return -EINVAL;
+		}
+	} else {
+		if (src_len > METADATA_BLOCK_SIZE)
+			return -EINVAL;
+
+		ret = sqfs_image_read(table->image, dest, src_len,
+				      offset + HEADER_SIZE);
+		if (ret)
+			return ret;
+
+		dest_len = src_len;
+	}
+
+	/* Only the last block of a table may be partially filled */
+	if (k == table->block_count - 1) {
+		table->size = (size_t)k * METADATA_BLOCK_SIZE + dest_len;
+	} else if (dest_len != METADATA_BLOCK_SIZE) {
+		printe("%s: Truncated metadata block.\n", __func__);
+		return -EINVAL;
+	}
+
+	table->loaded[k] = true;
+
+	return 0;
+}
+
+/*
+ * Convert a (block, offset) pair, as stored in inode references and directory
+ * entries, into a position in the uncompressed table. 'block' is the on-disk
+ * offset of the metadata block, relative to the start of the table.
+ */
+int64_t sqfs_meta_table_pos(struct sqfs_meta_table *table, uint32_t block,
+			    uint16_t offset)
+{
+	int low = 0, high = table->block_count - 1, mid;
+
+	if (offset >= METADATA_BLOCK_SIZE)
+		return -EINVAL;
+
+	while (low <= high) {
+		mid = low + (high - low) / 2;
+		if (table->block_offsets[mid] == block)
+			return (int64_t)mid * METADATA_BLOCK_SIZE + offset;
+		else if (table->block_offsets[mid] < block)
+			low = mid + 1;
+		else
+			high = mid - 1;
+	}
+
+	printd("No metadata block at offset 0x%x\n", block);
+
+	return -EINVAL;
+}
+
+/*
+ * Decompress every block of the table at once. Afterwards, the table is only
+ * read, so it can be shared by several threads.
+ */
+int sqfs_meta_table_load_all(struct sqfs_meta_table *table)
+{
+	int k, ret;
+
+	for (k = 0; k < table->block_count; k++) {
+		if (table->loaded[k])
+			continue;
+
+		ret = sqfs_meta_table_load(table, k);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Return a pointer to 'size' contiguous uncompressed bytes starting at 'pos',
+ * decompressing the blocks they span if needed, or NULL if the range does not
+ * fit in the table.
+ */
+void *sqfs_meta_table_at(struct sqfs_meta_table *table, uint64_t pos,
+			 size_t size)
+{
+	int k, first, last;
+
+	if (!size)
+		return pos <= table->size ? table->data + pos : NULL;
+
+	if (pos + size > table->size)
+		return NULL;
+
+	first = pos / METADATA_BLOCK_SIZE;
+	last = (pos + size - 1) / METADATA_BLOCK_SIZE;
+	for (k = first; k <= last; k++) {
+		if (!table->loaded[k] && sqfs_meta_table_load(table, k))
+			return NULL;
+	}
+
+	/* The last block may turn out to be shorter than expected */
+	if (pos + size > table->size)
+		return NULL;
+
+	return table->data + pos;
+}
+
+void *sqfs_meta_table_get(struct sqfs_meta_table *table, uint32_t block,
+			  uint16_t offset, size_t size)
+{
+	int64_t pos;
+
+	pos = sqfs_meta_table_pos(table, block, offset);
+	if (pos < 0)
+		return NULL;
+
+	return sqfs_meta_table_at(table, pos, size);
+}
+
+int sqfs_meta_cache_init(struct sqfs_meta_cache *cache,
+			 struct sqfs_image *img, struct sqfs_decomp *decomp,
+			 struct sqfs_arena *arena, int capacity)
+{
+	int k;
+
+	memset(cache, 0, sizeof(*cache));
+	if (capacity <= 0)
+		return -EINVAL;
+
+	cache->image = img;
+	cache->decomp = decomp;
+	cache->capacity = capacity;
+
+	/* Keep the load factor of the hash table below 1 */
+	for (cache->bucket_count = 1; cache->bucket_count < capacity;
+	     cache->bucket_count <<= 1)
+		;
+
+	cache->entries = sqfs_arena_zalloc(arena, capacity *
+					   sizeof(*cache->entries));
+	cache->buckets = sqfs_arena_zalloc(arena, cache->bucket_count *
+					   sizeof(*cache->buckets));
+	cache->blocks = sqfs_arena_alloc(arena, (size_t)capacity *
+					 METADATA_BLOCK_SIZE);
+	if (!cache->entries || !cache->buckets || !cache->blocks)
+		return -ENOMEM;
+
+	for (k = 0; k < capacity; k++)
+		cache->entries[k].data = cache->blocks +
+			(size_t)k * METADATA_BLOCK_SIZE;
+
+	return 0;
+}
+
+static int sqfs_meta_cache_hash(struct sqfs_meta_cache *cache,
+				uint64_t offset)
+{
+	return (offset ^ (offset >> 13)) & (cache->bucket_count - 1);
+}
+
+static void sqfs_meta_cache_unlink(struct sqfs_meta_cache *cache,
+				   struct sqfs_meta_cache_entry *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		cache->head = e->next;
+
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		cache->tail = e->prev;
+
+	e->prev = NULL;
+	e->next = NULL;
+}
+
+static void sqfs_meta_cache_push(struct sqfs_meta_cache *cache,
+				 struct sqfs_meta_cache_entry *e)
+{
+	e->prev = NULL;
+	e->next = cache->head;
+	if (cache->head)
+		cache->head->prev = e;
+	cache->head = e;
+	if (!cache->tail)
+		cache->tail = e;
+}
+
+/* Remove an entry from its hash bucket, before it gets recycled */
+static void sqfs_meta_cache_unhash(struct sqfs_meta_cache *cache,
+				   struct sqfs_meta_cache_entry *e)
+{
+	struct sqfs_meta_cache_entry **p;
+
+	p = &cache->buckets[sqfs_meta_cache_hash(cache, e->offset)];
+	while (*p && *p != e)
+		p = &(*p)->hnext;
+	if (*p)
+		*p = e->hnext;
+	e->hnext = NULL;
+}
+
+/*
+ * Return the uncompressed content of the metadata block stored at 'offset' in
+ * the image and set *size to its length. The pointer remains valid until the
+ * block gets evicted, i.e. after 'capacity' other blocks have been requested.
+ * Uncompressed blocks are returned straight from the image if it is in memory.
+ */
+void *sqfs_meta_cache_get(struct sqfs_meta_cache *cache, uint64_t offset,
+			  size_t *size)
+{
+	struct sqfs_meta_cache_entry *e;
+	size_t src_len, dest_len;
+	const void *src;
+	bool compressed;
+	int bucket, ret;
+
+	ret = sqfs_read_metablock(cache->image, offset, &compressed,
+				  &src_len);
+	if (ret)
+		return NULL;
+
+	if (!compressed && cache->image->base) {
+		*size = src_len;
+		return (void *)sqfs_image_view(cache->image,
+					       offset + HEADER_SIZE, src_len);
+	}
+
+	bucket = sqfs_meta_cache_hash(cache, offset);
+	for (e = cache->buckets[bucket]; e; e = e->hnext) {
+		if (e->offset == offset) {
+			cache->hits++;
+			sqfs_meta_cache_unlink(cache, e);
+			sqfs_meta_cache_push(cache, e);
+			*size = e->size;
+			return e->data;
+		}
+	}
+
+	cache->misses++;
+
+	/* Use a free entry while there is one, otherwise recycle the LRU */
+	if (cache->count < cache->capacity) {
+		e = &cache->entries[cache->count++];
+	} else {
+		e = cache->tail;
+		sqfs_meta_cache_unlink(cache, e);
+		sqfs_meta_cache_unhash(cache, e);
+	}
+
+	src = sqfs_image_view(cache->image, offset + HEADER_SIZE, src_len);
+	if (!src || (!compressed && src_len > METADATA_BLOCK_SIZE)) {
+		ret = -EIO;
+	} else if (compressed) {
+		dest_len = METADATA_BLOCK_SIZE;
+		ret = sqfs_decompress(cache->decomp, e->data, &dest_len, src,
+				      src_len);
+	} else {
+		memcpy(e->data, src, src_len);
+		dest_len = src_len;
+	}
+
+	if (ret) {
+		printe("%s: Error while uncompressing metadata.\n", __func__);
+		/* Keep the entry in the LRU list, but out of the hash table */
+		e->offset = SQUASHFS_INVALID_BLK;
+		sqfs_meta_cache_push(cache, e);
+		return NULL;
+	}
+
+	e->offset = offset;
+	e->size = dest_len;
+	e->hnext = cache->buckets[bucket];
+	cache->buckets[bucket] = e;
+	sqfs_meta_cache_push(cache, e);
+	*size = dest_len;
+
+	return e->data;
+}
+
+/*
+ * The directory table is followed by the fragment, export, id and xattr
+ * tables. Its end is the first metadata block of whichever comes next, which
+ * is pointed to by the first entry of that table's index.
+ */
+static void sqfs_table_end(struct sqfs_image *img, uint64_t index_start,
+			   uint64_t *end)
+{
+	uint64_t index;
+
+	if (index_start == SQUASHFS_INVALID_BLK)
+		return;
+
+	/* Left to the directory table parser to complain about */
+	if (sqfs_image_read(img, &index, sizeof(index), index_start))
+		return;
+
+	if (index < *end)
+		*end = index;
+}
+
+static uint64_t sqfs_dir_table_end(struct sqfs_image *img,
+				   struct squashfs_super_block *sblk)
+{
+	uint64_t end = sblk->bytes_used;
+
+	if (sblk->fragments)
+		sqfs_table_end(img, sblk->fragment_table_start, &end);
+
+	sqfs_table_end(img, sblk->lookup_table_start, &end);
+	sqfs_table_end(img, sblk->id_table_start, &end);
+
+	/* The xattr id table starts by the offset of the xattr metadata */
+	sqfs_table_end(img, sblk->xattr_id_table_start, &end);
+
+	return end;
+}
+
+int sqfs_ctx_init(struct sqfs_ctx *ctx, struct sqfs_image *img)
+{
+	struct squashfs_super_block *sblk = (void *)img->head;
+	union sqfs_compression_opts opts;
+	int ret;
+
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->image = img;
+	ctx->sblk = sblk;
+	ctx->threads = 1;
+
+	/* The table readers rely on these, do not trust any other image */
+	if (sblk->s_magic != SQUASHFS_MAGIC ||
+	    sblk->s_major != SQUASHFS_MAJOR ||
+	    sblk->block_size < SQUASHFS_BLOCK_MIN ||
+	    sblk->block_size > SQUASHFS_BLOCK_MAX || sblk->block_log >= 32 ||
+	    sblk->block_size != 1U << sblk->block_log) {
+		printe("Not a SquashFS 4.0 image.\n");
+		return -EINVAL;
+	}
+
+	ret = sqfs_fill_sblk_flags(&ctx->sblkf, sblk->flags);
+	if (ret)
+		return ret;
+
+	if (ctx->sblkf.compressor_options) {
+		ret = sqfs_fill_compression_opts(&opts, sblk->compression,
+						 img->head);
+		if (ret)
+			return ret;
+	}
+
+	ret = sqfs_decomp_init(&ctx->decomp, sblk->compression,
+			       ctx->sblkf.compressor_options ? &opts : NULL);
+	if (ret)
+		return ret;
+
+	ret = sqfs_buf_pool_init(&ctx->buffers, sblk->block_size,
+				 img->huge_pages);
+	if (ret)
+		goto free_decomp;
+
+	sqfs_arena_init(&ctx->arena, SQFS_ARENA_CHUNK);
+
+	ret = sqfs_meta_table_init(&ctx->inode_table, img, &ctx->decomp,
+				   &ctx->arena, sblk->inode_table_start,
+				   sblk->directory_table_start);
+	if (ret) {
+		printe("Error while reading the inode table.\n");
+		goto free_arena;
+	}
+
+	ret = sqfs_meta_table_init(&ctx->dir_table, img, &ctx->decomp,
+				   &ctx->arena, sblk->directory_table_start,
+				   sqfs_dir_table_end(img, sblk));
+	if (ret) {
+		printe("Error while reading the directory table.\n");
+		goto free_arena;
+	}
+
+	ret = sqfs_meta_cache_init(&ctx->meta_cache, img, &ctx->decomp,
+				   &ctx->arena, SQFS_META_CACHE_ENTRIES);
+	if (ret)
+		goto free_arena;
+
+	ret = sqfs_frag_cache_init(&ctx->frag_cache, ctx,
+				   SQFS_FRAG_CACHE_ENTRIES);
+	if (ret)
+		goto free_arena;
+
+	return 0;
+
+free_arena:
+	sqfs_arena_free(&ctx->arena);
+	sqfs_buf_pool_free(&ctx->buffers);
+free_decomp:
+	sqfs_decomp_free(&ctx->decomp);
+
+	return ret;
+}
+
+void sqfs_ctx_free(struct sqfs_ctx *ctx)
+{
+	printd("Metadata cache: %lu hits, %lu misses\n", ctx->meta_cache.hits,
+	       ctx->meta_cache.misses);
+
+	sqfs_frag_cache_free(&ctx->frag_cache);
+	sqfs_buf_pool_free(&ctx->buffers);
+	sqfs_decomp_free(&ctx->decomp);
+	/* Tables, metadata cache and inode index */
+	sqfs_arena_free(&ctx->arena);
+}
@@ -0,0 +1,227 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Bootlin
+ *
+ * Author: Joao Marcos Costa <joaomarcos.costa@bootlin.com>
+ *
+ * sqfs_output.c: write file content to a file descriptor
+ */
+
+/* copy_file_range() and splice() */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "sqfs_filesystem.h"
+#include "sqfs_utils.h"
+
+/* Only exposed by <limits.h> with _XOPEN_SOURCE, 1024 on Linux */
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/* In-kernel copy methods, dropped once they turn out not to be supported */
+#define SQFS_COPY_FILE_RANGE BIT(0)
+#define SQFS_COPY_SPLICE BIT(1)
+
+static int sqfs_copy_methods = SQFS_COPY_FILE_RANGE | SQFS_COPY_SPLICE;
+
+void sqfs_sink_init(struct sqfs_sink *sink, int fd, uint64_t size)
+{
+	sink->fd = fd;
+	sink->remaining = size;
+
+	/* Do not let buffered messages end up after the file content */
+	if (fd == STDOUT_FILENO)
+		fflush(stdout);
+}
+
+int sqfs_sink_write(struct sqfs_sink *sink, const void *buf, size_t len)
+{
+	struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+
+	return sqfs_sink_writev(sink, &iov, 1);
+}
+
+/*
+ * Write the buffers described by 'iov', the last ones being cut or skipped
+ * once the file size is reached. Short writes are resumed where they stopped,
+ * and 'iov' is modified in the process.
+ */
+int sqfs_sink_writev(struct sqfs_sink *sink, struct iovec *iov, int iovcnt)
+{
+	uint64_t total = 0;
+	ssize_t written;
+	int k, count;
+
+	for (k = 0; k < iovcnt; k++) {
+		if (total + iov[k].iov_len >= sink->remaining) {
+			iov[k].iov_len = sink->remaining - total;
+			iovcnt = k + 1;
+			break;
+		}
+
+		total += iov[k].iov_len;
+	}
+
+	while (iovcnt > 0) {
+		/* Skip the buffers already written (or empty) */
+		if (!iov->iov_len) {
+			iov++;
+			iovcnt--;
+			continue;
+		}
+
+		count = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+		written = writev(sink->fd, iov, count);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			printe("%s: Write error.\n", __func__);
+			return -errno;
+		}
+
+		sink->remaining -= written;
+		for (; written && written >= iov->iov_len; iov++, iovcnt--)
+			written -= iov->iov_len;
+
+		if (written) {
+			iov->iov_base += written;
+			iov->iov_len -= written;
+		}
+	}
+
+	return 0;
+}
+
+/* pwrite(2) the whole buffer, resuming short writes */
+int sqfs_pwrite(int fd, const void *buf, size_t len, uint64_t offset)
+{
+	ssize_t written;
+
+	while (len) {
+		written = pwrite(fd, buf, len, offset);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			printe("%s: Write error.\n", __func__);
+			return -errno;
+		}
+
+		buf += written;
+		offset += written;
+		len -= written;
+	}
+
+	return 0;
+}
+
+/* Errors meaning that a copy method cannot be used with these files */
+static bool sqfs_copy_unsupported(int error)
+{
+	return error == ENOSYS || error == EXDEV || error == EINVAL ||
+	       error == EOPNOTSUPP;
+}
+
+static int sqfs_copy_methods_get(void)
+{
+	return __atomic_load_n(&sqfs_copy_methods, __ATOMIC_RELAXED);
+}
+
+static void sqfs_copy_disable(int method)
+{
+	__atomic_and_fetch(&sqfs_copy_methods, ~method, __ATOMIC_RELAXED);
+}
+
+/* Move the data through a pipe, both files being given explicit offsets */
+static int sqfs_splice_range(int fd_in, loff_t *off_in, int fd_out,
+			     loff_t *off_out, size_t *len)
+{
+	ssize_t in, out;
+	int pipefd[2];
+	int ret = 0;
+
+	if (pipe(pipefd))
+		return -errno;
+
+	while (*len && !ret) {
+		in = splice(fd_in, off_in, pipefd[1], NULL, *len,
+			    SPLICE_F_MOVE);
+		if (in <= 0) {
+			ret = in ? -errno : -EIO;
+			break;
+		}
+
+		*len -= in;
+		while (in) {
+			out = splice(pipefd[0], NULL, fd_out, off_out, in,
+				     SPLICE_F_MOVE);
+			if (out <= 0) {
+				/* Whatever is left in the pipe is lost */
+				ret = out ? -errno : -EIO;
+				break;
+			}
+
+			in -= out;
+		}
+	}
+
+	close(pipefd[0]);
+	close(pipefd[1]);
+
+	return ret;
+}
+
+/*
+ * Copy 'len' bytes from 'fd_in' at 'off_in' to 'fd_out' at 'off_out' without
+ * going through user space: copy_file_range(2) lets the filesystem share or
+ * copy the extents, splice(2) through a pipe is tried otherwise. File offsets
+ * are left untouched, so several threads may copy to the same file. Returns
+ * -EOPNOTSUPP if none of them can be used, the caller then has to write the
+ * whole range itself.
+ */
+int sqfs_copy_range(int fd_in, uint64_t off_in, int fd_out, uint64_t off_out,
+		    size_t len)
+{
+	loff_t in = off_in, out = off_out;
+	ssize_t copied;
+	int ret;
+
+	while (len && (sqfs_copy_methods_get() & SQFS_COPY_FILE_RANGE)) {
+		copied = copy_file_range(fd_in, &in, fd_out, &out, len, 0);
+		if (copied > 0) {
+			len -= copied;
+			continue;
+		}
+
+		if (!copied)
+			return -EIO;
+		if (errno == EINTR)
+			continue;
+		if (!sqfs_copy_unsupported(errno))
+			return -errno;
+
+		sqfs_copy_disable(SQFS_COPY_FILE_RANGE);
+	}
+
+	if (!len)
+		return 0;
+
+	/* Go on from where copy_file_range() stopped */
+	if (!(sqfs_copy_methods_get() & SQFS_COPY_SPLICE))
+		return -EOPNOTSUPP;
+
+	ret = sqfs_splice_range(fd_in, &in, fd_out, &out, &len);
+	if (ret && sqfs_copy_unsupported(-ret)) {
+		sqfs_copy_disable(SQFS_COPY_SPLICE);
+		return -EOPNOTSUPP;
+	}
+
+	return ret;
+}
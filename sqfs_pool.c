@@ -0,0 +1,253 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Bootlin
+ *
+ * Author: Joao Marcos Costa <joaomarcos.costa@bootlin.com>
+ *
+ * sqfs_pool.c: work-stealing thread pool
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sqfs_pool.h"
+#include "sqfs_utils.h"
+
+#define SQFS_DEQUE_INITIAL_CAPACITY 64
+
+struct sqfs_worker_arg {
+	struct sqfs_pool *pool;
+	int id;
+};
+
+/* Pool and index of the calling thread, if it is a worker */
+static __thread struct sqfs_pool *sqfs_current_pool;
+static __thread int sqfs_current_worker;
+
+static int sqfs_deque_push(struct sqfs_deque *dq, struct sqfs_task *task)
+{
+	struct sqfs_task **tasks;
+	size_t k, capacity;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->count == dq->capacity) {
+		capacity = dq->capacity ? 2 * dq->capacity :
+			SQFS_DEQUE_INITIAL_CAPACITY;
+		tasks = malloc(capacity * sizeof(*tasks));
+		if (!tasks) {
+			pthread_mutex_unlock(&dq->lock);
+			return -ENOMEM;
+		}
+
+		/* Unwrap the ring buffer */
+		for (k = 0; k < dq->count; k++)
+			tasks[k] = dq->tasks[(dq->head + k) % dq->capacity];
+
+		free(dq->tasks);
+		dq->tasks = tasks;
+		dq->capacity = capacity;
+		dq->head = 0;
+	}
+
+	dq->tasks[(dq->head + dq->count) % dq->capacity] = task;
+	dq->count++;
+	pthread_mutex_unlock(&dq->lock);
+
+	return 0;
+}
+
+/* Take a task from the tail ('steal' is false) or the head of 'dq' */
+static struct sqfs_task *sqfs_deque_take(struct sqfs_deque *dq, bool steal)
+{
+	struct sqfs_task *task = NULL;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->count) {
+		dq->count--;
+		if (steal) {
+			task = dq->tasks[dq->head];
+			dq->head = (dq->head + 1) % dq->capacity;
+		} else {
+			task = dq->tasks[(dq->head + dq->count) %
+					 dq->capacity];
+		}
+	}
+
+	pthread_mutex_unlock(&dq->lock);
+
+	return task;
+}
+
+static struct sqfs_task *sqfs_pool_take(struct sqfs_pool *pool, int id)
+{
+	struct sqfs_task *task;
+	int k;
+
+	task = sqfs_deque_take(&pool->deques[id], false);
+	for (k = 1; !task && k < pool->threads; k++)
+		task = sqfs_deque_take(&pool->deques[(id + k) % pool->threads],
+				       true);
+
+	if (task)
+		__atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+
+	return task;
+}
+
+static void *sqfs_pool_worker(void *arg)
+{
+	struct sqfs_worker_arg *warg = arg;
+	struct sqfs_pool *pool = warg->pool;
+	struct sqfs_task *task;
+	int id = warg->id;
+
+	free(warg);
+	sqfs_current_pool = pool;
+	sqfs_current_worker = id;
+
+	for (;;) {
+		task = sqfs_pool_take(pool, id);
+		if (!task) {
+			pthread_mutex_lock(&pool->lock);
+			while (!pool->stop &&
+			       !__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST))
+				pthread_cond_wait(&pool->work_cond, &pool->lock);
+
+			if (pool->stop) {
+				pthread_mutex_unlock(&pool->lock);
+				break;
+			}
+
+			pthread_mutex_unlock(&pool->lock);
+			continue;
+		}
+
+		task->run(task, id);
+
+		if (!__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST)) {
+			pthread_mutex_lock(&pool->lock);
+			pthread_cond_broadcast(&pool->idle_cond);
+			pthread_mutex_unlock(&pool->lock);
+		}
+	}
+
+	return NULL;
+}
+
+int sqfs_pool_init(struct sqfs_pool *pool, int threads)
+{
+	struct sqfs_worker_arg *warg;
+	int k;
+
+	memset(pool, 0, sizeof(*pool));
+	pool->deques = calloc(threads, sizeof(*pool->deques));
+	pool->workers = calloc(threads, sizeof(*pool->workers));
+	if (!pool->deques || !pool->workers) {
+		printe("%s: Memory allocation error.\n", __func__);
+		free(pool->deques);
+		free(pool->workers);
+		return -ENOMEM;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->idle_cond, NULL);
+	for (k = 0; k < threads; k++)
+		pthread_mutex_init(&pool->deques[k].lock, NULL);
+
+	/* Tasks may be submitted as soon as the first worker exists */
+	pool->threads = threads;
+	for (k = 0; k < threads; k++) {
+		warg = malloc(sizeof(*warg));
+		if (!warg)
+			break;
+
+		warg->pool = pool;
+		warg->id = k;
+		if (pthread_create(&pool->workers[k], NULL, sqfs_pool_worker,
+				   warg)) {
+			free(warg);
+			break;
+		}
+
+		pool->started++;
+	}
+
+	if (k < threads) {
+		printe("%s: Cannot create thread.\n", __func__);
+		sqfs_pool_free(pool);
+		return -EAGAIN;
+	}
+
+	return 0;
+}
+
+/*
+ * Queue 'task'. Workers push the tasks they submit onto their own deque,
+ * other threads spread them over the deques in turn.
+ */
+int sqfs_pool_submit(struct sqfs_pool *pool, struct sqfs_task *task)
+{
+	unsigned int id;
+	int ret;
+
+	if (sqfs_current_pool == pool)
+		id = sqfs_current_worker;
+	else
+		id = __atomic_fetch_add(&pool->next_deque, 1,
+					__ATOMIC_RELAXED) % pool->threads;
+
+	__atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+	ret = sqfs_deque_push(&pool->deques[id], task);
+	if (ret) {
+		__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+		return ret;
+	}
+
+	__atomic_add_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+
+	/* Taking the lock orders this wakeup with a worker going to sleep */
+	pthread_mutex_lock(&pool->lock);
+	pthread_cond_signal(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	return 0;
+}
+
+/* Wait until all submitted tasks, and those they submitted, are done */
+void sqfs_pool_wait(struct sqfs_pool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST))
+		pthread_cond_wait(&pool->idle_cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/* Stop the workers once they are idle; queued tasks are not run */
+void sqfs_pool_free(struct sqfs_pool *pool)
+{
+	int k;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (k = 0; k < pool->started; k++)
+		pthread_join(pool->workers[k], NULL);
+
+	for (k = 0; k < pool->threads; k++) {
+		pthread_mutex_destroy(&pool->deques[k].lock);
+		free(pool->deques[k].tasks);
+	}
+
+	pthread_cond_destroy(&pool->idle_cond);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->deques);
+	free(pool->workers);
+}
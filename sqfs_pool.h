@@ -0,0 +1,57 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2020 Bootlin
+ *
+ * Author: Joao Marcos Costa <joaomarcos.costa@bootlin.com>
+ *
+ * sqfs_pool.h:	work-stealing thread pool, included at sqfs_pool.c and
+ *		sqfs_extract.c
+ */
+
+#ifndef SQFS_POOL_H
+#define SQFS_POOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Unit of work. The pool does not own tasks: 'run' is expected to free the
+ * structure embedding the task, if needed. 'worker' is the index of the
+ * thread running it, in [0, threads).
+ */
+struct sqfs_task {
+	void (*run)(struct sqfs_task *task, int worker);
+};
+
+/*
+ * Per-worker double-ended queue. The owner pushes and pops tasks at the
+ * tail (most recent first, for locality), idle workers steal from the head.
+ */
+struct sqfs_deque {
+	pthread_mutex_t lock;
+	struct sqfs_task **tasks;
+	size_t head, count, capacity;
+};
+
+struct sqfs_pool {
+	int threads;
+	/* Workers actually created, fewer than 'threads' if one failed */
+	int started;
+	pthread_t *workers;
+	struct sqfs_deque *deques;
+	/* Tasks waiting in the deques, and tasks not completed yet */
+	unsigned long queued, pending;
+	/* Deque used by the next task submitted from outside the pool */
+	unsigned int next_deque;
+	bool stop;
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond, idle_cond;
+};
+
+int sqfs_pool_init(struct sqfs_pool *pool, int threads);
+int sqfs_pool_submit(struct sqfs_pool *pool, struct sqfs_task *task);
+void sqfs_pool_wait(struct sqfs_pool *pool);
+void sqfs_pool_free(struct sqfs_pool *pool);
+
+#endif /* SQFS_POOL_H */
@@ -16,6 +16,7 @@
 #include <time.h>
 
 #include "sqfs_decompressor.h"
+#include "sqfs_image.h"
 #include "sqfs_utils.h"
 
 /*
@@ -23,7 +24,7 @@
  * https://www.kernel.org/doc/Documentation/filesystems/squashfs.txt
  * https://dr-emann.github.io/squashfs/
  */
-int sqfs_dump_sblk(void *file_mapping)
+int sqfs_dump_sblk(struct sqfs_image *img)
 {
 	struct squashfs_super_block *sblk;
 	union sqfs_compression_opts opts;
@@ -33,7 +34,7 @@ int sqfs_dump_sblk(void *file_mapping)
 	time_t rawtime;
 	int ret;
 
-	sblk = file_mapping;
+	sblk = (void *)img->head;
 	rawtime = sblk->mkfs_time;
 	timestamp = *localtime(&rawtime);
 	strftime(fs_creation_date, sizeof(fs_creation_date),
@@ -138,7 +139,7 @@ int sqfs_dump_sblk(void *file_mapping)
 	/* Detailing (if available) compression options */
 	if (sblkf.compressor_options) {
 		ret = sqfs_fill_compression_opts(&opts, sblk->compression,
-						 file_mapping);
+						 img->head);
 		if (ret)
 			return -EFAULT;
 		ret = sqfs_dump_compression_opts(sblk->compression, &opts);
@@ -156,7 +157,7 @@ int sqfs_dump_sblk(void *file_mapping)
 int sqfs_fill_sblk_flags(struct super_block_flags *sblkf, unsigned short flags)
 {
 	if (!sblkf) {
-		printf("Error while filling super block flags\n");
+		printe("Error while filling super block flags\n");
 		return -EINVAL;
 	}
 	sblkf->uncompressed_inodes = CHECK_FLAG(flags, 0);
@@ -0,0 +1,236 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Copyright (C) 2020 Bootlin
+ *
+ * Author: Joao Marcos Costa <joaomarcos.costa@bootlin.com>
+ *
+ * sqfs_uring.c: asynchronous reads with io_uring, without liburing
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "sqfs_uring.h"
+
+#ifdef CONFIG_SQFS_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int sqfs_io_uring_setup(unsigned int entries,
+			       struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sqfs_io_uring_enter(int fd, unsigned int to_submit,
+			       unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+int sqfs_uring_init(struct sqfs_uring *ring, unsigned int entries)
+{
+	struct io_uring_params p;
+	int ret;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+
+	ring->fd = sqfs_io_uring_setup(entries, &p);
+	if (ring->fd < 0)
+		return -errno;
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries *
+			     sizeof(unsigned int);
+	ring->cq_ring_size = p.cq_off.cqes + p.cq_entries *
+			     sizeof(struct io_uring_cqe);
+
+	/* Recent kernels map both rings at once */
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = 0;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		ring->sq_ring = NULL;
+		ret = -errno;
+		goto free_ring;
+	}
+
+	if (ring->cq_ring_size) {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+				     PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, ring->fd,
+				     IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			ring->cq_ring = NULL;
+			ret = -errno;
+			goto free_ring;
+		}
+	}
+
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd,
+			  IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		ret = -errno;
+		goto free_ring;
+	}
+
+	ring->sq_head = ring->sq_ring + p.sq_off.head;
+	ring->sq_tail = ring->sq_ring + p.sq_off.tail;
+	ring->sq_mask = ring->sq_ring + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ring + p.sq_off.array;
+
+	if (!ring->cq_ring)
+		ring->cq_ring = ring->sq_ring;
+	ring->cq_head = ring->cq_ring + p.cq_off.head;
+	ring->cq_tail = ring->cq_ring + p.cq_off.tail;
+	ring->cq_mask = ring->cq_ring + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_ring + p.cq_off.cqes;
+
+	return 0;
+
+free_ring:
+	sqfs_uring_free(ring);
+
+	return ret;
+}
+
+void sqfs_uring_free(struct sqfs_uring *ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	if (ring->fd >= 0)
+		close(ring->fd);
+
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+}
+
+/*
+ * Queue the read of 'len' bytes at 'offset' in 'fd'. Nothing is passed to the
+ * kernel before sqfs_uring_submit() or sqfs_uring_wait().
+ */
+int sqfs_uring_read(struct sqfs_uring *ring, int fd, void *buf, size_t len,
+		    uint64_t offset, uint64_t user_data)
+{
+	unsigned int head, tail, index;
+	struct io_uring_sqe *sqe;
+
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	tail = *ring->sq_tail;
+	if (tail - head > *ring->sq_mask)
+		return -EBUSY;
+
+	index = tail & *ring->sq_mask;
+	sqe = (struct io_uring_sqe *)ring->sqes + index;
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->user_data = user_data;
+
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->to_submit++;
+
+	return 0;
+}
+
+int sqfs_uring_submit(struct sqfs_uring *ring)
+{
+	int ret;
+
+	while (ring->to_submit) {
+		ret = sqfs_io_uring_enter(ring->fd, ring->to_submit, 0, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		ring->to_submit -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Submit the queued reads and wait for one of them to complete. '*res' is
+ * the number of bytes read or a negative error code.
+ */
+int sqfs_uring_wait(struct sqfs_uring *ring, uint64_t *user_data, int *res)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head;
+	int ret;
+
+	ret = sqfs_uring_submit(ring);
+	if (ret)
+		return ret;
+
+	head = *ring->cq_head;
+	while (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		ret = sqfs_io_uring_enter(ring->fd, 0, 1,
+					  IORING_ENTER_GETEVENTS);
+		if (ret < 0 && errno != EINTR)
+			return -errno;
+	}
+
+	cqe = (struct io_uring_cqe *)ring->cqes + (head & *ring->cq_mask);
+	*user_data = cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+#else /* !CONFIG_SQFS_URING */
+
+int sqfs_uring_init(struct sqfs_uring *ring, unsigned int entries)
+{
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+
+	return -EOPNOTSUPP;
+}
+
+void sqfs_uring_free(struct sqfs_uring *ring)
+{
+}
+
+int sqfs_uring_read(struct sqfs_uring *ring, int fd, void *buf, size_t len,
+		    uint64_t offset, uint64_t user_data)
+{
+	return -EOPNOTSUPP;
+}
+
+int sqfs_uring_submit(struct sqfs_uring *ring)
+{
+	return -EOPNOTSUPP;
+}
+
+int sqfs_uring_wait(struct sqfs_uring *ring, uint64_t *user_data, int *res)
+{
+	return -EOPNOTSUPP;
+}
+
+#endif /* CONFIG_SQFS_URING */
@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Copyright (C) 2020 Bootlin
+ *
+ * Author: Joao Marcos Costa <joaomarcos.costa@bootlin.com>
+ *
+ * sqfs_uring.h:	minimal io_uring wrapper for asynchronous reads, included
+ *			at sqfs_filesystem.h
+ */
+
+#ifndef SQFS_URING_H
+#define SQFS_URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Submission and completion rings shared with the kernel, set up with the
+ * raw system calls. Only used by one thread at a time.
+ */
+struct sqfs_uring {
+	int fd;
+	/* Submission ring, and the array of entries it indexes */
+	void *sq_ring;
+	size_t sq_ring_size;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	void *sqes;
+	size_t sqes_size;
+	/* Entries queued since the last io_uring_enter() */
+	unsigned int to_submit;
+	/* Completion ring, unless it shares the submission ring's mapping */
+	void *cq_ring;
+	size_t cq_ring_size;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	void *cqes;
+};
+
+int sqfs_uring_init(struct sqfs_uring *ring, unsigned int entries);
+void sqfs_uring_free(struct sqfs_uring *ring);
+int sqfs_uring_read(struct sqfs_uring *ring, int fd, void *buf, size_t len,
+		    uint64_t offset, uint64_t user_data);
+int sqfs_uring_submit(struct sqfs_uring *ring);
+int sqfs_uring_wait(struct sqfs_uring *ring, uint64_t *user_data, int *res);
+
+#endif /* SQFS_URING_H */
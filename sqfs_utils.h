@@ -21,6 +21,9 @@
 #define BITS_PER_LONG 64
 #define GENMASK(h, l) \
 	(((~0UL) << (l)) & (~0UL >> (BITS_PER_LONG - 1 - (h))))
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+#define ALIGN(x, a) (DIV_ROUND_UP(x, a) * (a))
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
 
 /* Metadata blocks start by a 2-byte length header */
 #define HEADER_SIZE 2
@@ -48,6 +51,14 @@
 	} \
 	} while (0)\
 
+/*
+ * Error messages only go to stderr once the program asked for them: a library
+ * caller gets the negative errno value alone.
+ */
+extern bool sqfs_print_errors;
+#define printe(...) \
+	do { if (sqfs_print_errors) fprintf(stderr, __VA_ARGS__); } while (0)
+
 #define METADATA_BLOCK_SIZE 8192
 
 typedef __signed__ char __s8;
@@ -65,6 +76,13 @@ typedef __u32 __bitwise __be32;
 typedef __u64 __bitwise __le64;
 typedef __u64 __bitwise __be64;
 
+/* "hsqs", the only version supported being 4.0 */
+#define SQUASHFS_MAGIC 0x73717368
+#define SQUASHFS_MAJOR 4
+/* Bounds of the data block size, which is a power of 2 */
+#define SQUASHFS_BLOCK_MIN (4 << 10)
+#define SQUASHFS_BLOCK_MAX (1 << 20)
+
 struct squashfs_super_block {
 	__le32 s_magic;
 	__le32 inodes;
@@ -114,7 +132,9 @@ enum squashfs_compression_type {
 	ZSTD,
 };
 
-int sqfs_dump_sblk(void *file_mapping);
+struct sqfs_image;
+
+int sqfs_dump_sblk(struct sqfs_image *img);
 int sqfs_fill_sblk_flags(struct super_block_flags *sblkf, unsigned short flags);
 int sqfs_dump_sblk_flags(struct super_block_flags *sblkf);
 